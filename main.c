@@ -1,11 +1,28 @@
+#define _GNU_SOURCE // copy_file_range
+
 #include "zlib/include/zconf.h"
 #include "zlib/include/zlib.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
 #include <raylib.h>
 #include <raymath.h>
 
@@ -54,13 +71,13 @@ void panic(const char *message) {
     exit(69);
 }
 
+// inflates a whole zlib stream into out, 0 if it's broken or doesn't end
+// there. with partial, filling out before the end is fine too
 uLong zinflate(unsigned char *in, unsigned char *out, uLong comprLen,
-               uLong uncomprLen) {
+               uLong uncomprLen, bool partial) {
     int err;
     z_stream d_stream; /* decompression stream */
 
-    strcpy((char *)out, "garbage");
-
     d_stream.zalloc = (alloc_func)0;
     d_stream.zfree = (free_func)0;
     d_stream.opaque = (voidpf)0;
@@ -75,17 +92,16 @@ uLong zinflate(unsigned char *in, unsigned char *out, uLong comprLen,
         panic("error with inflate init");
     }
 
-    inflate(&d_stream, Z_FINISH);
-    if (err != Z_OK && err != Z_STREAM_END) {
-        panic("error with inflate");
-    }
+    err = inflate(&d_stream, Z_FINISH);
+    bool ok = err == Z_STREAM_END ||
+              (partial && err == Z_BUF_ERROR && d_stream.avail_out == 0);
 
     err = inflateEnd(&d_stream);
     if (err != Z_OK) {
         panic("error with inflate after ending");
     }
 
-    return d_stream.total_out;
+    return ok ? d_stream.total_out : 0;
 }
 
 uint convert_uint(uint8_t *buff) {
@@ -108,134 +124,802 @@ static inline uint8_t paeth_predictor(uint8_t a, uint8_t b, uint8_t c) {
         return c;
 }
 
-// i don't know where I got this from, but I do know that I didn't write it
-void recon(uint8_t *data, uint8_t *out, int width, int height, int bpp) {
-    int stride = width * bpp;
-    uint8_t *prev_row = calloc(stride, 1);
-    uint8_t *cur_row = data;
-    uint8_t *dst = out;
+// one filter over a row. with a constant bpp the loop over the bytes of a
+// pixel is unrolled and x >= bpp is gone, the first pixel is done on its own
+static inline __attribute__((always_inline)) void
+recon_filter(uint8_t filter, uint8_t *cur_row, uint8_t *prev_row,
+             uint8_t *dst, int stride, int bpp) {
+    switch (filter) {
+    case 1:
+        memcpy(dst, cur_row, bpp);
+        for (int x = bpp; x < stride; x += bpp)
+            for (int i = 0; i < bpp; i++)
+                dst[x + i] = cur_row[x + i] + dst[x + i - bpp];
+        break;
+    case 2:
+        for (int x = 0; x < stride; x++)
+            dst[x] = cur_row[x] + prev_row[x];
+        break;
+    case 3:
+        for (int i = 0; i < bpp; i++)
+            dst[i] = cur_row[i] + (prev_row[i] >> 1);
+        for (int x = bpp; x < stride; x += bpp)
+            for (int i = 0; i < bpp; i++)
+                dst[x + i] = cur_row[x + i] +
+                             ((dst[x + i - bpp] + prev_row[x + i]) >> 1);
+        break;
+    case 4:
+        // nothing on the left, paeth picks above
+        for (int i = 0; i < bpp; i++)
+            dst[i] = cur_row[i] + prev_row[i];
+        for (int x = bpp; x < stride; x += bpp)
+            for (int i = 0; i < bpp; i++)
+                dst[x + i] = cur_row[x + i] +
+                             paeth_predictor(dst[x + i - bpp], prev_row[x + i],
+                                             prev_row[x + i - bpp]);
+        break;
+    default:
+        memcpy(dst, cur_row, stride);
+        break;
+    }
+}
 
-    for (int y = 0; y < height; y++) {
-        uint8_t filter = *cur_row++;
-        for (int x = 0; x < stride; x++) {
-            uint8_t raw = cur_row[x];
-            uint8_t recon;
+typedef void (*ReconFn)(uint8_t *cur_row, uint8_t *prev_row, uint8_t *dst,
+                        int stride);
 
-            uint8_t left = (x >= bpp) ? dst[x - bpp] : 0;
-            uint8_t above = prev_row[x];
-            uint8_t upper_left = (x >= bpp) ? prev_row[x - bpp] : 0;
+// recon_<filter>_<bpp>() for every filter and bpp a png can have
+#define RECON_FN(filter, bpp)                                                  \
+    void recon_##filter##_##bpp(uint8_t *cur_row, uint8_t *prev_row,           \
+                                uint8_t *dst, int stride) {                    \
+        recon_filter(filter, cur_row, prev_row, dst, stride, bpp);             \
+    }
+#define RECON_FNS(bpp)                                                         \
+    RECON_FN(0, bpp)                                                           \
+    RECON_FN(1, bpp)                                                           \
+    RECON_FN(2, bpp)                                                           \
+    RECON_FN(3, bpp)                                                           \
+    RECON_FN(4, bpp)
+#define RECON_TABLE(bpp)                                                       \
+    {recon_0_##bpp, recon_1_##bpp, recon_2_##bpp, recon_3_##bpp, recon_4_##bpp}
 
-            switch (filter) {
-            case 0:
-                recon = raw;
-                break;
-            case 1:
-                recon = raw + left;
-                break;
-            case 2:
-                recon = raw + above;
-                break;
-            case 3:
-                recon = raw + ((left + above) >> 1);
-                break;
-            case 4:
-                recon = raw + paeth_predictor(left, above, upper_left);
-                break;
-            default:
-                recon = raw;
-                break;
-            }
+RECON_FNS(1)
+RECON_FNS(2)
+RECON_FNS(3)
+RECON_FNS(4)
+RECON_FNS(6)
+RECON_FNS(8)
+
+// [bpp][filter]
+ReconFn recon_fns[9][5] = {
+    [1] = RECON_TABLE(1), [2] = RECON_TABLE(2), [3] = RECON_TABLE(3),
+    [4] = RECON_TABLE(4), [6] = RECON_TABLE(6), [8] = RECON_TABLE(8),
+};
+
+// unknown filters leave the row as it is
+void recon_row(uint8_t filter, uint8_t *cur_row, uint8_t *prev_row,
+               uint8_t *dst, int stride, int bpp) {
+    filter = filter <= 4 ? filter : 0;
+    if (bpp <= 8 && recon_fns[bpp][filter])
+        recon_fns[bpp][filter](cur_row, prev_row, dst, stride);
+    else
+        recon_filter(filter, cur_row, prev_row, dst, stride, bpp);
+}
+
+/*
+ * CPU dispatch
+ *
+ * the SIMD kernels are picked at runtime, so one binary runs everywhere and
+ * the widest thing the CPU has gets used. kernels.isa is the level, found
+ * once with CPUID at startup, and PODER_ISA=scalar|sse2|ssse3|sse4.1|avx2|
+ * avx512 forces a lower one. kernels compiled for a level have their own
+ * function in the table, the SSE2 ones that are always compiled on x86-64
+ * check kernels.isa instead so they can be switched off too.
+ */
+
+typedef enum {
+    ISA_SCALAR,
+    ISA_SSE2,
+    ISA_SSSE3,
+    ISA_SSE41,
+    ISA_AVX2, // with FMA
+    ISA_AVX512, // F and BW
+    ISA_COUNT,
+} Isa;
+
+const char *isa_names[ISA_COUNT] = {"scalar", "sse2",   "ssse3",
+                                    "sse4.1", "avx2",   "avx512"};
+
+typedef void (*ReconRowFn)(uint8_t filter, uint8_t *cur_row, uint8_t *prev_row,
+                           uint8_t *dst, int stride, int bpp);
+
+// the best level this CPU can run
+Isa cpu_isa(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+        return ISA_AVX512;
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        return ISA_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+        return ISA_SSE41;
+    if (__builtin_cpu_supports("ssse3"))
+        return ISA_SSSE3;
+    if (__builtin_cpu_supports("sse2"))
+        return ISA_SSE2;
+#endif
+    return ISA_SCALAR;
+}
+
+// cpu_isa(), or lower if PODER_ISA says so
+Isa detect_isa(void) {
+    Isa isa = cpu_isa();
+    const char *forced = getenv("PODER_ISA");
+    if (forced == NULL || *forced == '\0')
+        return isa;
+
+    for (Isa i = 0; i < ISA_COUNT; i++) {
+        if (strcasecmp(forced, isa_names[i]) != 0)
+            continue;
+        if (i > isa) {
+            fprintf(stderr, "PODER_ISA=%s: this CPU only has %s\n", forced,
+                    isa_names[isa]);
+            return isa;
+        }
+        return i;
+    }
+    fprintf(stderr, "PODER_ISA=%s: unknown, using %s\n", forced,
+            isa_names[isa]);
+    return isa;
+}
+
+#ifdef __SSE2__
+typedef __m128i (*PaethFn)(__m128i a, __m128i b, __m128i c);
+
+// paeth_predictor() of 16 bit lanes: pa = |b - c|, pb = |a - c|,
+// pc = |a + b - 2c|, abs as max(x, -x)
+__m128i paeth_sse2(__m128i a, __m128i b, __m128i c) {
+    __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+    // x <= y is y + 1 > x
+    __m128i pb1 = _mm_add_epi16(pb, one), pc1 = _mm_add_epi16(pc, one);
+    __m128i use_a = _mm_and_si128(_mm_cmpgt_epi16(pb1, pa),
+                                  _mm_cmpgt_epi16(pc1, pa));
+    __m128i use_b = _mm_cmpgt_epi16(pc1, pb);
+    __m128i p = _mm_or_si128(_mm_and_si128(use_b, b),
+                             _mm_andnot_si128(use_b, c));
+    return _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, p));
+}
+
+__attribute__((target("ssse3"))) __m128i paeth_ssse3(__m128i a, __m128i b,
+                                                     __m128i c) {
+    __m128i one = _mm_set1_epi16(1);
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+    pa = _mm_abs_epi16(pa);
+    pb = _mm_abs_epi16(pb);
+
+    __m128i pb1 = _mm_add_epi16(pb, one), pc1 = _mm_add_epi16(pc, one);
+    __m128i use_a = _mm_and_si128(_mm_cmpgt_epi16(pb1, pa),
+                                  _mm_cmpgt_epi16(pc1, pa));
+    __m128i use_b = _mm_cmpgt_epi16(pc1, pb);
+    __m128i p = _mm_or_si128(_mm_and_si128(use_b, b),
+                             _mm_andnot_si128(use_b, c));
+    return _mm_or_si128(_mm_and_si128(use_a, a), _mm_andnot_si128(use_a, p));
+}
+
+// x <= y is min(x, y) == x, and blends instead of and/or
+__attribute__((target("sse4.1"))) __m128i paeth_sse41(__m128i a, __m128i b,
+                                                      __m128i c) {
+    __m128i pa = _mm_sub_epi16(b, c);
+    __m128i pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+    pa = _mm_abs_epi16(pa);
+    pb = _mm_abs_epi16(pb);
+
+    __m128i use_a = _mm_cmpeq_epi16(_mm_min_epu16(pa, _mm_min_epu16(pb, pc)),
+                                    pa);
+    __m128i use_b = _mm_cmpeq_epi16(_mm_min_epu16(pb, pc), pb);
+    return _mm_blendv_epi8(_mm_blendv_epi8(c, b, use_b), a, use_a);
+}
+
+// sub, average and paeth go a pixel at a time, each needs the one on its
+// left. up has no such chain and is left to the caller
+static inline __attribute__((always_inline)) void
+recon_pixels(uint8_t filter, uint8_t *cur_row, uint8_t *prev_row, uint8_t *dst,
+             int stride, int bpp, PaethFn paeth) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = zero, c = zero; // left and upper left
+    uint8_t px[16] = {0};
+
+    for (int x = 0; x < stride; x += bpp) {
+        memcpy(px, cur_row + x, bpp);
+        __m128i raw = _mm_loadl_epi64((__m128i *)px);
+        memcpy(px, prev_row + x, bpp);
+        __m128i b = _mm_loadl_epi64((__m128i *)px);
+
+        __m128i d;
+        if (filter == 1) {
+            d = _mm_add_epi8(raw, a);
+        } else if (filter == 3) {
+            // _mm_avg_epu8 rounds up, the average filter wants floor
+            __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+                                       _mm_and_si128(_mm_xor_si128(a, b), one));
+            d = _mm_add_epi8(raw, avg);
+        } else {
+            __m128i p = paeth(_mm_unpacklo_epi8(a, zero),
+                              _mm_unpacklo_epi8(b, zero),
+                              _mm_unpacklo_epi8(c, zero));
+            d = _mm_add_epi8(raw, _mm_packus_epi16(p, p));
+        }
+
+        _mm_storel_epi64((__m128i *)px, d);
+        memcpy(dst + x, px, bpp);
+        a = d;
+        c = b;
+    }
+}
+
+// recon_row() for the filters that chain, bpp of 3 to 8 with a constant bpp
+// each so the copies become single loads. false if the scalar one has to do it
+static inline __attribute__((always_inline)) bool
+recon_chained(uint8_t filter, uint8_t *cur_row, uint8_t *prev_row,
+              uint8_t *dst, int stride, int bpp, PaethFn paeth) {
+    if (filter != 1 && filter != 3 && filter != 4)
+        return false;
+
+    switch (bpp) {
+    case 3:
+        recon_pixels(filter, cur_row, prev_row, dst, stride, 3, paeth);
+        return true;
+    case 4:
+        recon_pixels(filter, cur_row, prev_row, dst, stride, 4, paeth);
+        return true;
+    case 6:
+        recon_pixels(filter, cur_row, prev_row, dst, stride, 6, paeth);
+        return true;
+    case 8:
+        recon_pixels(filter, cur_row, prev_row, dst, stride, 8, paeth);
+        return true;
+    }
+    return false;
+}
+
+void recon_row_sse2(uint8_t filter, uint8_t *cur_row, uint8_t *prev_row,
+                    uint8_t *dst, int stride, int bpp) {
+    if (filter == 2) {
+        int x = 0;
+        for (; x + 16 <= stride; x += 16)
+            _mm_storeu_si128(
+                (__m128i *)(dst + x),
+                _mm_add_epi8(_mm_loadu_si128((__m128i *)(cur_row + x)),
+                             _mm_loadu_si128((__m128i *)(prev_row + x))));
+        for (; x < stride; x++)
+            dst[x] = cur_row[x] + prev_row[x];
+        return;
+    }
+    if (!recon_chained(filter, cur_row, prev_row, dst, stride, bpp,
+                       paeth_sse2))
+        recon_row(filter, cur_row, prev_row, dst, stride, bpp);
+}
+
+__attribute__((target("ssse3"))) void
+recon_row_ssse3(uint8_t filter, uint8_t *cur_row, uint8_t *prev_row,
+                uint8_t *dst, int stride, int bpp) {
+    if (!recon_chained(filter, cur_row, prev_row, dst, stride, bpp,
+                       paeth_ssse3))
+        recon_row_sse2(filter, cur_row, prev_row, dst, stride, bpp);
+}
+
+__attribute__((target("sse4.1"))) void
+recon_row_sse41(uint8_t filter, uint8_t *cur_row, uint8_t *prev_row,
+                uint8_t *dst, int stride, int bpp) {
+    if (!recon_chained(filter, cur_row, prev_row, dst, stride, bpp,
+                       paeth_sse41))
+        recon_row_sse2(filter, cur_row, prev_row, dst, stride, bpp);
+}
+
+// only up gets wider, the others are one pixel at a time anyway
+__attribute__((target("avx2"))) void
+recon_row_avx2(uint8_t filter, uint8_t *cur_row, uint8_t *prev_row,
+               uint8_t *dst, int stride, int bpp) {
+    if (filter != 2) {
+        recon_row_sse41(filter, cur_row, prev_row, dst, stride, bpp);
+        return;
+    }
+
+    int x = 0;
+    for (; x + 32 <= stride; x += 32)
+        _mm256_storeu_si256(
+            (__m256i *)(dst + x),
+            _mm256_add_epi8(_mm256_loadu_si256((__m256i *)(cur_row + x)),
+                            _mm256_loadu_si256((__m256i *)(prev_row + x))));
+    for (; x < stride; x++)
+        dst[x] = cur_row[x] + prev_row[x];
+}
+
+__attribute__((target("avx512f,avx512bw"))) void
+recon_row_avx512(uint8_t filter, uint8_t *cur_row, uint8_t *prev_row,
+                 uint8_t *dst, int stride, int bpp) {
+    if (filter != 2) {
+        recon_row_sse41(filter, cur_row, prev_row, dst, stride, bpp);
+        return;
+    }
+
+    // the tail is one masked op instead of a scalar loop
+    for (int x = 0; x < stride; x += 64) {
+        __mmask64 m = stride - x >= 64 ? ~0ull : (1ull << (stride - x)) - 1;
+        __m512i cur = _mm512_maskz_loadu_epi8(m, cur_row + x);
+        __m512i up = _mm512_maskz_loadu_epi8(m, prev_row + x);
+        _mm512_mask_storeu_epi8(dst + x, m, _mm512_add_epi8(cur, up));
+    }
+}
+#endif
+
+/*
+ * Pixel conversion
+ *
+ * the kernels that turn reconstructed rows into what the caller asked for,
+ * RGBA8, BGRA8 or RGBA16 in native byte order. 8 bit color types get one
+ * shuffle per 16 bytes with SSSE3 (gray only needs SSE2 unpacks), 16 bit
+ * samples are narrowed to their high byte or byte swapped first with SSE2.
+ * palettes, bit depths below 8 and tRNS keys go through convert_row()'s
+ * generic path.
+ *
+ * premultiplying alpha happens on the converted row while it's still in cache,
+ * rounded exactly like v * a / 255 would be. groups of opaque pixels are only
+ * read, so opaque rows cost a compare per 4 pixels.
+ */
+
+typedef enum {
+    OUTPUT_RGBA8,
+    OUTPUT_BGRA8,
+    OUTPUT_RGBA16, // native byte order
+} OutputFormat;
+
+typedef enum {
+    CONVERT_RGB_RGBA,
+    CONVERT_RGB_BGRA,
+    CONVERT_RGBA_BGRA,
+    CONVERT_GRAY_RGBA, // BGRA is the same
+    CONVERT_GA_RGBA,
+    CONVERT_NARROW16, // big endian 16 bit samples to their high byte
+    CONVERT_SWAP16,   // big endian 16 bit samples to native
+    CONVERT_WIDEN8,   // 8 bit samples to native 16 bit, v * 257
+    CONVERT_PREMULTIPLY8,  // RGBA8 or BGRA8, alpha is the 4th byte either way
+    CONVERT_PREMULTIPLY16, // native RGBA16
+    CONVERT_COUNT,
+} Convert;
+
+// count is pixels for the color conversions and samples for the others.
+// premultiplying works in place with src == dst
+typedef void (*ConvertFn)(uint8_t *src, uint8_t *dst, uint32_t count);
+
+size_t output_bpp(OutputFormat format) {
+    return format == OUTPUT_RGBA16 ? 8 : 4;
+}
+
+void rgb_to_rgba(uint8_t *src, uint8_t *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++, src += 3, dst += 4) {
+        dst[0] = src[0], dst[1] = src[1], dst[2] = src[2];
+        dst[3] = 255;
+    }
+}
+
+void rgb_to_bgra(uint8_t *src, uint8_t *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++, src += 3, dst += 4) {
+        dst[0] = src[2], dst[1] = src[1], dst[2] = src[0];
+        dst[3] = 255;
+    }
+}
+
+void rgba_to_bgra(uint8_t *src, uint8_t *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++, src += 4, dst += 4) {
+        dst[0] = src[2], dst[1] = src[1], dst[2] = src[0];
+        dst[3] = src[3];
+    }
+}
+
+void gray_to_rgba(uint8_t *src, uint8_t *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++, dst += 4) {
+        dst[0] = dst[1] = dst[2] = src[i];
+        dst[3] = 255;
+    }
+}
+
+void ga_to_rgba(uint8_t *src, uint8_t *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++, src += 2, dst += 4) {
+        dst[0] = dst[1] = dst[2] = src[0];
+        dst[3] = src[1];
+    }
+}
+
+void narrow16(uint8_t *src, uint8_t *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++)
+        dst[i] = src[i * 2];
+}
+
+void swap16(uint8_t *src, uint8_t *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t v = src[i * 2] << 8 | src[i * 2 + 1];
+        memcpy(dst + i * 2, &v, 2);
+    }
+}
+
+void widen8(uint8_t *src, uint8_t *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint16_t v = src[i] * 257;
+        memcpy(dst + i * 2, &v, 2);
+    }
+}
+
+// v * a / 255 rounded to nearest, x + (x >> 8) >> 8 is x / 255 for these x
+static inline uint8_t mul255(uint32_t v, uint32_t a) {
+    uint32_t x = v * a + 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+void premultiply8(uint8_t *src, uint8_t *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++, src += 4, dst += 4) {
+        uint8_t a = src[3];
+        dst[0] = mul255(src[0], a);
+        dst[1] = mul255(src[1], a);
+        dst[2] = mul255(src[2], a);
+        dst[3] = a;
+    }
+}
+
+// the same with 65535 and 16 more bits
+void premultiply16(uint8_t *src, uint8_t *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++, src += 8, dst += 8) {
+        uint16_t px[4];
+        memcpy(px, src, 8);
+        for (int c = 0; c < 3; c++) {
+            uint32_t x = (uint32_t)px[c] * px[3] + 32768;
+            px[c] = (x + (x >> 16)) >> 16;
+        }
+        memcpy(dst, px, 8);
+    }
+}
+
+#ifdef __SSE2__
+// x86 is little endian, so native is the swapped big endian
+void narrow16_sse2(uint8_t *src, uint8_t *dst, uint32_t count) {
+    const __m128i low = _mm_set1_epi16(0xff);
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i *)(src + i * 2));
+        __m128i b = _mm_loadu_si128((__m128i *)(src + i * 2 + 16));
+        _mm_storeu_si128((__m128i *)(dst + i),
+                         _mm_packus_epi16(_mm_and_si128(a, low),
+                                          _mm_and_si128(b, low)));
+    }
+    narrow16(src + i * 2, dst + i, count - i);
+}
+
+void swap16_sse2(uint8_t *src, uint8_t *dst, uint32_t count) {
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((__m128i *)(src + i * 2));
+        _mm_storeu_si128((__m128i *)(dst + i * 2),
+                         _mm_or_si128(_mm_slli_epi16(v, 8),
+                                      _mm_srli_epi16(v, 8)));
+    }
+    swap16(src + i * 2, dst + i * 2, count - i);
+}
 
-            dst[x] = recon;
+void widen8_sse2(uint8_t *src, uint8_t *dst, uint32_t count) {
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i * 2), _mm_unpacklo_epi8(v, v));
+        _mm_storeu_si128((__m128i *)(dst + i * 2 + 16),
+                         _mm_unpackhi_epi8(v, v));
+    }
+    widen8(src + i, dst + i * 2, count - i);
+}
+
+// 16 gray pixels, gg and g ff pairs interleave to g g g ff
+void gray_to_rgba_sse2(uint8_t *src, uint8_t *dst, uint32_t count) {
+    const __m128i alpha = _mm_set1_epi8(-1);
+    uint32_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i v = _mm_loadu_si128((__m128i *)(src + i));
+        __m128i gg[2] = {_mm_unpacklo_epi8(v, v), _mm_unpackhi_epi8(v, v)};
+        __m128i ga[2] = {_mm_unpacklo_epi8(v, alpha),
+                         _mm_unpackhi_epi8(v, alpha)};
+        uint8_t *d = dst + i * 4;
+        for (int k = 0; k < 2; k++, d += 32) {
+            _mm_storeu_si128((__m128i *)d, _mm_unpacklo_epi16(gg[k], ga[k]));
+            _mm_storeu_si128((__m128i *)(d + 16),
+                             _mm_unpackhi_epi16(gg[k], ga[k]));
+        }
+    }
+    gray_to_rgba(src + i, dst + i * 4, count - i);
+}
+
+// 4 pixels at a time as 16 bit lanes, the alpha lane gets multiplied by 255
+// so it comes out the same. opaque groups are left alone
+void premultiply8_sse2(uint8_t *src, uint8_t *dst, uint32_t count) {
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i keep = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i *)(src + i * 4));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, alpha),
+                                              alpha)) == 0xffff) {
+            if (src != dst)
+                _mm_storeu_si128((__m128i *)(dst + i * 4), v);
+            continue;
+        }
+        __m128i half[2] = {_mm_unpacklo_epi8(v, zero),
+                           _mm_unpackhi_epi8(v, zero)};
+        for (int k = 0; k < 2; k++) {
+            __m128i a = _mm_shufflehi_epi16(
+                _mm_shufflelo_epi16(half[k], _MM_SHUFFLE(3, 3, 3, 3)),
+                _MM_SHUFFLE(3, 3, 3, 3));
+            __m128i x = _mm_add_epi16(
+                _mm_mullo_epi16(half[k], _mm_or_si128(a, keep)), round);
+            half[k] = _mm_srli_epi16(_mm_add_epi16(x, _mm_srli_epi16(x, 8)), 8);
         }
+        _mm_storeu_si128((__m128i *)(dst + i * 4),
+                         _mm_packus_epi16(half[0], half[1]));
+    }
+    premultiply8(src + i * 4, dst + i * 4, count - i);
+}
+
+// 4 rgb pixels are 12 bytes, the load takes 16 so it stops 2 pixels early
+__attribute__((target("ssse3"))) void
+rgb_shuffle_ssse3(uint8_t *src, uint8_t *dst, uint32_t count, __m128i order) {
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    uint32_t i = 0;
+    for (; i + 6 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i *)(src + i * 3));
+        _mm_storeu_si128((__m128i *)(dst + i * 4),
+                         _mm_or_si128(_mm_shuffle_epi8(v, order), alpha));
+    }
+    for (; i < count; i++) {
+        dst[i * 4 + 3] = 255;
+        for (int c = 0; c < 3; c++)
+            dst[i * 4 + c] = src[i * 3 + ((uint8_t *)&order)[c]];
+    }
+}
+
+__attribute__((target("ssse3"))) void
+rgb_to_rgba_ssse3(uint8_t *src, uint8_t *dst, uint32_t count) {
+    rgb_shuffle_ssse3(src, dst, count,
+                      _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9,
+                                    10, 11, -1));
+}
 
-        memcpy(prev_row, dst, stride);
-        dst += stride;
-        cur_row += stride;
+__attribute__((target("ssse3"))) void
+rgb_to_bgra_ssse3(uint8_t *src, uint8_t *dst, uint32_t count) {
+    rgb_shuffle_ssse3(src, dst, count,
+                      _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11,
+                                    10, 9, -1));
+}
+
+__attribute__((target("ssse3"))) void
+rgba_to_bgra_ssse3(uint8_t *src, uint8_t *dst, uint32_t count) {
+    const __m128i order =
+        _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i v = _mm_loadu_si128((__m128i *)(src + i * 4));
+        _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_shuffle_epi8(v, order));
+    }
+    rgba_to_bgra(src + i * 4, dst + i * 4, count - i);
+}
+
+// 8 gray and alpha pixels, 2 shuffles of 4 each
+__attribute__((target("ssse3"))) void
+ga_to_rgba_ssse3(uint8_t *src, uint8_t *dst, uint32_t count) {
+    const __m128i lo =
+        _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6, 7);
+    const __m128i hi = _mm_add_epi8(lo, _mm_set1_epi8(8));
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m128i v = _mm_loadu_si128((__m128i *)(src + i * 2));
+        _mm_storeu_si128((__m128i *)(dst + i * 4), _mm_shuffle_epi8(v, lo));
+        _mm_storeu_si128((__m128i *)(dst + i * 4 + 16),
+                         _mm_shuffle_epi8(v, hi));
     }
+    ga_to_rgba(src + i * 2, dst + i * 4, count - i);
+}
+#endif
+
+typedef struct {
+    Isa isa;
+    ReconRowFn recon_row;
+    ConvertFn convert[CONVERT_COUNT];
+} Kernels;
+
+#define SCALAR_CONVERT                                                         \
+    {rgb_to_rgba, rgb_to_bgra, rgba_to_bgra, gray_to_rgba, ga_to_rgba,         \
+     narrow16,    swap16,      widen8,       premultiply8, premultiply16}
 
-    free(prev_row);
+// scalar until use_isa()
+Kernels kernels = {ISA_SCALAR, recon_row, SCALAR_CONVERT};
+
+// fills the kernel table for isa, which has to be at most cpu_isa()
+void use_isa(Isa isa) {
+    kernels = (Kernels){isa, recon_row, SCALAR_CONVERT};
+#ifdef __SSE2__
+    ReconRowFn recon[ISA_COUNT] = {recon_row,       recon_row_sse2,
+                                   recon_row_ssse3, recon_row_sse41,
+                                   recon_row_avx2,  recon_row_avx512};
+    kernels.recon_row = recon[isa];
+
+    ConvertFn *convert = kernels.convert;
+    if (isa >= ISA_SSE2) {
+        convert[CONVERT_NARROW16] = narrow16_sse2;
+        convert[CONVERT_SWAP16] = swap16_sse2;
+        convert[CONVERT_WIDEN8] = widen8_sse2;
+        convert[CONVERT_GRAY_RGBA] = gray_to_rgba_sse2;
+        convert[CONVERT_PREMULTIPLY8] = premultiply8_sse2;
+    }
+    if (isa >= ISA_SSSE3) {
+        convert[CONVERT_RGB_RGBA] = rgb_to_rgba_ssse3;
+        convert[CONVERT_RGB_BGRA] = rgb_to_bgra_ssse3;
+        convert[CONVERT_RGBA_BGRA] = rgba_to_bgra_ssse3;
+        convert[CONVERT_GA_RGBA] = ga_to_rgba_ssse3;
+    }
+#endif
 }
 
-bool validate_signature(FILE *file) {
+bool validate_signature(FILE *file, char *err, size_t errlen) {
     // 89 PNG(504E47) 0D 0A 1A 0A
     uint64_t sig = 0x89504E470D0A1A0A;
 
     uint8_t buff[8];
 
-    if (!fread(buff, CHAR, 8, file))
-        panic("Couldn't read signature");
+    if (fread(buff, CHAR, 8, file) != 8) {
+        snprintf(err, errlen, "too short for a PNG signature");
+        return false;
+    }
 
     uint64_t orig;
     memcpy(&orig, buff, 8);
     orig = __builtin_bswap64(orig); // big endian to little endian
 
-    if (sig != orig)
+    if (sig != orig) {
+        snprintf(err, errlen, "invalid PNG signature");
         return false;
+    }
 
     return true;
 }
 
-void render(uint width, uint height, Image image) {
-    // Raylib shit
-    SetTraceLogLevel(LOG_ERROR);
-    InitWindow(width, height, "Poder");
-    SetTargetFPS(60);
+// APNG dispose and blend ops from fcTL
+enum DisposeOp { DISPOSE_NONE, DISPOSE_BACKGROUND, DISPOSE_PREVIOUS };
+enum BlendOp { BLEND_SOURCE, BLEND_OVER };
 
-    Camera2D camera = {0};
-    camera.target = (Vector2){width / 2., height / 2.};
-    camera.offset = (Vector2){width / 2., height / 2.};
-    camera.rotation = 0.0f;
-    camera.zoom = 1.0f;
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t x;
+    uint32_t y;
+    uint16_t delay_num;
+    uint16_t delay_den;
+    uint8_t dispose;
+    uint8_t blend;
 
-    Texture2D texture = LoadTextureFromImage(image);
+    bool idat; // frame data is the IDAT, owned by the png
+    uint8_t *data; // fdAT data without the sequence numbers
+    size_t data_t;
+    size_t data_cap;
+} Frame;
 
-    while (!WindowShouldClose()) {
-        BeginDrawing();
-        BeginMode2D(camera);
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t bit_depth;
+    uint32_t color_type;
+    uint32_t interlace;
 
-        camera.zoom =
-            expf(logf(camera.zoom) + ((float)GetMouseWheelMove() * 0.1f));
-        camera.offset = GetMousePosition(); // no idea if both are required
-        camera.target = GetMousePosition(); // no idea if both are required
+    uint8_t palette[256 * 4]; // rgba, alpha from tRNS
+    uint32_t palette_size;
+    bool has_key; // tRNS color that is transparent, for gray and rgb
+    uint16_t key[3];
 
-        if (camera.zoom > 3.0f)
-            camera.zoom = 3.0f;
-        else if (camera.zoom < 1.f)
-            camera.zoom = 1.f;
+    // how samples map to light, see Color management
+    bool srgb;
+    uint32_t gamma;   // gAMA times 100000, 0 if there is none
+    bool has_chrm;
+    uint32_t chrm[8]; // cHRM white, red, green and blue x, y times 100000
+    uint8_t *icc;     // iCCP profile, still compressed
+    size_t icc_t;
 
-        ClearBackground(BLACK);
-        DrawTexture(texture, 0, 0, WHITE);
+    uint8_t *data; // contains entire compressed IDAT data
+    size_t data_t;
 
-        EndMode2D();
-        EndDrawing();
+    Frame *frames; // APNG frames, from acTL/fcTL/fdAT
+    uint32_t frame_count;
+    uint32_t plays; // 0 is forever
+} PNG;
+
+uint32_t channels(uint32_t color_type) {
+    switch (color_type) {
+    case COLOR_GRAYSCALE:
+    case COLOR_INDEXED:
+        return 1;
+    case COLOR_GRAYSCALE_ALPHA:
+        return 2;
+    case COLOR_TRUE_RGB:
+        return 3;
+    case COLOR_TRUEALPHA_RGBA:
+        return 4;
     }
+    return 0;
+}
 
-    UnloadImage(image);
-    UnloadTexture(texture);
+bool valid_depth(uint32_t color_type, uint32_t bit_depth) {
+    switch (color_type) {
+    case COLOR_GRAYSCALE:
+        return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 ||
+               bit_depth == 8 || bit_depth == 16;
+    case COLOR_INDEXED:
+        return bit_depth == 1 || bit_depth == 2 || bit_depth == 4 ||
+               bit_depth == 8;
+    case COLOR_TRUE_RGB:
+    case COLOR_GRAYSCALE_ALPHA:
+    case COLOR_TRUEALPHA_RGBA:
+        return bit_depth == 8 || bit_depth == 16;
+    }
+    return false;
+}
 
-    CloseWindow();
+// byte per pixel, at least 1 for the filters
+uint32_t png_bpp(PNG *png) {
+    uint32_t bits = channels(png->color_type) * png->bit_depth;
+    return bits < 8 ? 1 : bits / 8;
 }
 
-int main() {
-    const char* pngfile = "pngs/chart.png";
-    FILE *file = fopen(pngfile, "rb");
-    if (file == NULL) {
-        perror("fopen");
-        exit(69);
-    }
+// bytes in a row, without filter byte
+size_t png_stride(PNG *png) {
+    return ((size_t)png->width * channels(png->color_type) * png->bit_depth +
+            7) / 8;
+}
+
+void free_png(PNG *png) {
+    for (uint32_t i = 0; i < png->frame_count; i++)
+        if (!png->frames[i].idat)
+            free(png->frames[i].data);
+    free(png->frames);
+    free(png->data);
+    free(png->icc);
+}
+
+// forgets the last APNG frame
+void drop_frame(PNG *png) {
+    Frame *frame = &png->frames[--png->frame_count];
+    if (!frame->idat)
+        free(frame->data);
+    memset(frame, 0, sizeof(*frame));
+}
 
-    if (!validate_signature(file))
-        panic("Invalid PNG signature");
+// false with a message in err if the file is broken, png is empty then
+bool read_png_file(FILE *file, PNG *png, char *err, size_t errlen) {
+    if (!validate_signature(file, err, errlen))
+        return false;
+    bool ok = true;
 
     size_t data_cap = sizeof(uint8_t) * 2048;
     size_t data_t = 0;
-    uint8_t *data = malloc(data_cap); // contains entire compressed IDAT data
+    uint8_t *data = malloc(data_cap);
 
-    uint32_t width = 0;
-    uint32_t height = 0;
-    uint32_t bit_depth = 0;
-    uint32_t color_type = 0;
+    uint32_t frames_cap = 0;
+    uint32_t sequence = 0;          // next fcTL/fdAT sequence number
+    const char *apng_error = NULL; // frames stop before the first broken one
 
     char type[5];            // chunk type
     uint8_t buff[128] = {0}; // reading file bytes into
@@ -251,35 +935,169 @@ int main() {
 
         if (strcmp(type, "IHDR") == 0) {
             fread(buff, CHAR, LENGTH, file);
-            width = convert_uint(buff);
+            png->width = convert_uint(buff);
 
             fread(buff, CHAR, LENGTH, file);
-            height = convert_uint(buff);
+            png->height = convert_uint(buff);
 
             fread(buff, CHAR, CHAR, file);
-            bit_depth = buff[0];
+            png->bit_depth = buff[0];
 
             fread(buff, CHAR, CHAR, file);
-            color_type = buff[0];
+            png->color_type = buff[0];
 
-            // skipping compression method, filter method and interlace because
-            // they are always the same
-            fseek(file, 3, SEEK_CUR);
+            // skipping compression method and filter method because they are
+            // always the same
+            fread(buff, CHAR, 3, file);
+            png->interlace = buff[2];
         } else if (strcmp(type, "IDAT") == 0) {
-            uint8_t chunk[length];
-            fread(chunk, CHAR, length, file);
-
             if (data_cap - data_t < length) {
                 data_cap = (data_cap + length);
                 data = realloc(data, data_cap);
             }
 
-            memmove(data + data_t, chunk, length);
+            if (fread(data + data_t, CHAR, length, file) != length) {
+                snprintf(err, errlen, "IDAT chunk is cut short");
+                ok = false;
+                break;
+            }
             data_t += length;
+
+            // fcTL before the first IDAT makes the default image frame 0
+            if (png->frame_count == 1 && png->frames[0].data == NULL)
+                png->frames[0].idat = true;
+        } else if (strcmp(type, "acTL") == 0 && length == 8 && !png->frames) {
+            fread(buff, CHAR, length, file);
+            frames_cap = convert_uint(buff);
+            png->plays = convert_uint(buff + 4);
+            png->frames = calloc(frames_cap, sizeof(Frame));
+            if (png->frames == NULL)
+                frames_cap = 0;
+        } else if (strcmp(type, "fcTL") == 0 && !apng_error) {
+            Frame *last = png->frame_count ? &png->frames[png->frame_count - 1]
+                                           : NULL;
+            if (length != 26 || png->frame_count >= frames_cap) {
+                apng_error = "more fcTL than acTL frames";
+                fseek(file, length, SEEK_CUR);
+            } else if (last && !last->idat && !last->data_t) {
+                apng_error = "frame without any fdAT";
+                drop_frame(png);
+                fseek(file, length, SEEK_CUR);
+            } else {
+                fread(buff, CHAR, length, file);
+                Frame frame = {
+                    .width = convert_uint(buff + 4),
+                    .height = convert_uint(buff + 8),
+                    .x = convert_uint(buff + 12),
+                    .y = convert_uint(buff + 16),
+                    .delay_num = buff[20] << 8 | buff[21],
+                    .delay_den = buff[22] << 8 | buff[23],
+                    .dispose = buff[24],
+                    .blend = buff[25],
+                };
+                // the fcTL of the default image has to cover all of it
+                bool whole = frame.x == 0 && frame.y == 0 &&
+                             frame.width == png->width &&
+                             frame.height == png->height;
+                if (convert_uint(buff) != sequence++)
+                    apng_error = "sequence numbers out of order";
+                else if (frame.x + (uint64_t)frame.width > png->width ||
+                         frame.y + (uint64_t)frame.height > png->height ||
+                         !frame.width || !frame.height)
+                    apng_error = "frame outside the canvas";
+                else if (data_t == 0 && png->frame_count == 0 && !whole)
+                    apng_error = "first frame doesn't match the image";
+                else
+                    png->frames[png->frame_count++] = frame;
+            }
+        } else if (strcmp(type, "fdAT") == 0 && !apng_error) {
+            Frame *frame = png->frame_count
+                               ? &png->frames[png->frame_count - 1]
+                               : NULL;
+            if (length < 4 || !frame || frame->idat) {
+                apng_error = "fdAT without a frame";
+                fseek(file, length, SEEK_CUR);
+            } else {
+                fread(buff, CHAR, 4, file);
+                length -= 4;
+                if (convert_uint(buff) != sequence++) {
+                    apng_error = "sequence numbers out of order";
+                    drop_frame(png);
+                    fseek(file, length, SEEK_CUR);
+                } else {
+                    if (frame->data_cap - frame->data_t < length) {
+                        frame->data_cap = frame->data_cap * 2 + length;
+                        frame->data = realloc(frame->data, frame->data_cap);
+                    }
+                    if (fread(frame->data + frame->data_t, CHAR, length,
+                              file) != length) {
+                        snprintf(err, errlen, "fdAT chunk is cut short");
+                        ok = false;
+                        break;
+                    }
+                    frame->data_t += length;
+                }
+            }
+        } else if (strcmp(type, "fcTL") == 0 || strcmp(type, "fdAT") == 0) {
+            // the animation already stopped at a broken frame
+            fseek(file, length, SEEK_CUR);
         } else if (strcmp(type, "IEND") == 0) {
             // everything already done
         } else if (strcmp(type, "PLTE") == 0) {
-            panic("PLTE not handled");
+            png->palette_size = length / 3 < 256 ? length / 3 : 256;
+            for (uint32_t i = 0; i < png->palette_size; i++) {
+                fread(png->palette + i * 4, CHAR, 3, file);
+                png->palette[i * 4 + 3] = 255;
+            }
+            fseek(file, length - png->palette_size * 3, SEEK_CUR);
+        } else if (strcmp(type, "tRNS") == 0) {
+            // an alpha per palette entry at most, or one gray or rgb key
+            uint32_t max = png->color_type == COLOR_INDEXED ? png->palette_size
+                           : png->color_type == COLOR_GRAYSCALE ? 2
+                           : png->color_type == COLOR_TRUE_RGB  ? 6
+                                                                : 0;
+            bool exact = png->color_type != COLOR_INDEXED;
+            uint8_t trns[256];
+            if (!max || length > max || (exact && length != max)) {
+                snprintf(err, errlen, "tRNS of %u bytes doesn't fit", length);
+                ok = false;
+                break;
+            }
+            if (fread(trns, CHAR, length, file) != length) {
+                snprintf(err, errlen, "tRNS chunk is cut short");
+                ok = false;
+                break;
+            }
+            if (png->color_type == COLOR_INDEXED) {
+                for (uint32_t i = 0; i < length; i++)
+                    png->palette[i * 4 + 3] = trns[i];
+            } else {
+                png->has_key = true;
+                for (uint32_t i = 0; i < length / 2; i++)
+                    png->key[i] = trns[i * 2] << 8 | trns[i * 2 + 1];
+            }
+        } else if (strcmp(type, "gAMA") == 0 && length == 4) {
+            fread(buff, CHAR, length, file);
+            png->gamma = convert_uint(buff);
+        } else if (strcmp(type, "cHRM") == 0 && length == 32) {
+            fread(buff, CHAR, length, file);
+            png->has_chrm = true;
+            for (int i = 0; i < 8; i++)
+                png->chrm[i] = convert_uint(buff + i * 4);
+        } else if (strcmp(type, "sRGB") == 0 && length == 1) {
+            fread(buff, CHAR, length, file);
+            png->srgb = true;
+        } else if (strcmp(type, "iCCP") == 0 && !png->icc) {
+            // name, 0, compression method, then the zlib stream
+            uint8_t *chunk = malloc(length);
+            fread(chunk, CHAR, length, file);
+            uint8_t *end = memchr(chunk, 0, length < 80 ? length : 80);
+            if (end && end + 2 < chunk + length && end[1] == 0) {
+                png->icc_t = chunk + length - (end + 2);
+                png->icc = memmove(chunk, end + 2, png->icc_t);
+            } else {
+                free(chunk);
+            }
         } else {
             printf("Auxillary chunk(%s) or some error!: %u\n", type, length);
             fseek(file, length,
@@ -289,46 +1107,6388 @@ int main() {
         fseek(file, CRC, SEEK_CUR); // FIXME: skip CRC bytes
     }
 
-    printf("%s: %ux%u, %u depth and %u color type with %zu bytes data\n",
-           pngfile, width, height, bit_depth, color_type, data_t);
-
-    uint32_t bpp = (color_type == 6) ? 4 : 3; // byte per pixel
-
-    // uncompress IDAT chunks
-    uLong uncomprLen = (width * bpp + 1) * height; // + 1 for filter byte
-    uint8_t *uncompressed = malloc(uncomprLen);
-    uLong bytes = zinflate(data, uncompressed, data_t, uncomprLen);
-
-    // apply filtering to uncompressed
-    uint8_t *idat = malloc(width * height * bpp);
-    recon(uncompressed, idat, width, height, bpp);
-
-    uint8_t *raw = idat;
-    Image image = GenImageColor(width, height, BLACK); // write to image
-
-    for (int j = 0; j < height; j++) {
-        for (int i = 0; i < width; i++) {
-            if (!raw)
-                panic("raw is NULL");
-            Color color;
-            // FIXME: only supporting color_type 6 and 4
-            if (color_type == COLOR_TRUEALPHA_RGBA) {
-                color = (Color){raw[0], raw[1], raw[2], raw[3]};
-                raw += 4; // one pixel
-            } else if (color_type == COLOR_TRUE_RGB) {
-                color = (Color){raw[0], raw[1], raw[2], 255};
-                raw += 3; // one pixel
-            } else {
-                panic("Poder does not support color type");
-            }
-            ImageDrawPixel(&image, i, j, color);
+    png->data = data;
+    png->data_t = data_t;
+
+    if (!apng_error && png->frame_count) {
+        Frame *last = &png->frames[png->frame_count - 1];
+        if (!last->idat && !last->data_t) {
+            apng_error = "frame without any fdAT";
+            drop_frame(png);
+        }
+    }
+
+    for (uint32_t i = 0; i < png->frame_count; i++) {
+        if (png->frames[i].idat) {
+            png->frames[i].data = data;
+            png->frames[i].data_t = data_t;
         }
     }
 
+    // the still image is fine, only the animation is cut short
+    if (ok && apng_error)
+        printf("Broken APNG, %s: keeping %u frames\n", apng_error,
+               png->frame_count);
+
+    if (!ok) {
+        free_png(png);
+        memset(png, 0, sizeof(*png));
+    }
+    return ok;
+}
+
+bool load_png(const char *pngfile, PNG *png, char *err, size_t errlen) {
+    FILE *file = fopen(pngfile, "rb");
+    if (file == NULL) {
+        snprintf(err, errlen, "%s", strerror(errno));
+        return false;
+    }
+
+    bool ok = read_png_file(file, png, err, errlen);
     fclose(file);
-    free(uncompressed);
-    free(data);
-    free(idat);
+    return ok;
+}
+
+// for the command line, where a broken file ends it all
+void read_png(const char *pngfile, PNG *png) {
+    char err[256];
+    if (!load_png(pngfile, png, err, sizeof(err))) {
+        printf("%s: %s\n", pngfile, err);
+        exit(69);
+    }
+}
+
+/*
+ * Seek index
+ *
+ * All rows live in a single deflate stream, so getting to row y normally means
+ * inflating (and unfiltering) every row above it. While decoding we can take a
+ * snapshot of the inflate state at deflate block boundaries (same idea as
+ * zlib's examples/zran.c): the bit position in the IDAT data, the last 32K of
+ * inflated data as the dictionary, and since the filters look at the row above
+ * we also keep the reconstructed previous row and whatever part of the current
+ * row was already inflated. Resuming from such a point only needs
+ * inflatePrime() + inflateSetDictionary() on a raw inflate stream.
+ *
+ * The points are stored next to the png in a "<file>.pidx" sidecar.
+ */
+
+#define WINSIZE 32768 // deflate window
+#define PIDX_MAGIC 0x58444950 // "PIDX"
+#define PIDX_VERSION 2
+
+typedef struct {
+    uint64_t in;       // offset into the IDAT data
+    uint64_t out;      // offset into the inflated data
+    uint32_t y;        // row being inflated
+    uint32_t have;     // bytes of row y (including filter byte) inflated
+    uint32_t dict_len; // bytes in window
+    uint8_t bits;      // bits of data[in - 1] not consumed yet
+
+    uint8_t *window;   // last 32K of inflated data before the point
+    uint8_t *row;      // the first have bytes of row y, still filtered
+    uint8_t *prev_row; // row y - 1, reconstructed
+} AccessPoint;
+
+typedef struct {
+    uint32_t span; // minimum rows between two points
+    uint32_t count;
+    uint32_t cap;
+    AccessPoint *points;
+} SeekIndex;
+
+typedef struct {
+    PNG *png;
+    z_stream strm;
+
+    uint32_t bpp;
+    size_t stride;
+
+    uint8_t *filtered; // filter byte + row as it comes out of inflate
+    size_t have;       // bytes of filtered that are inflated
+    uint8_t *prev_row;
+    uint8_t *cur_row;
+    uint32_t y; // next row row_reader_next() returns
+
+    SeekIndex *index; // if set, access points are recorded into it
+    uint32_t next_point;
+
+    const char *error; // why row_reader_next() ran out of rows early
+} RowReader;
+
+void row_reader_init(RowReader *r, PNG *png) {
+    memset(r, 0, sizeof(*r));
+    r->png = png;
+    r->bpp = png_bpp(png);
+    r->stride = png_stride(png);
+
+    r->filtered = malloc(r->stride + 1);
+    r->prev_row = calloc(r->stride, 1);
+    r->cur_row = malloc(r->stride);
+
+    if (inflateInit(&r->strm) != Z_OK)
+        panic("error with inflate init");
+
+    r->strm.next_in = png->data;
+    r->strm.avail_in = png->data_t;
+}
+
+void row_reader_end(RowReader *r) {
+    inflateEnd(&r->strm);
+    free(r->filtered);
+    free(r->prev_row);
+    free(r->cur_row);
+}
+
+void add_access_point(RowReader *r) {
+    SeekIndex *index = r->index;
+    if (index->count == index->cap) {
+        index->cap = index->cap ? index->cap * 2 : 16;
+        index->points = realloc(index->points, index->cap * sizeof(AccessPoint));
+    }
+
+    AccessPoint *p = &index->points[index->count++];
+    p->in = r->strm.total_in;
+    p->out = r->strm.total_out;
+    p->y = r->y;
+    p->have = r->have;
+    p->bits = r->strm.data_type & 7;
+
+    p->window = malloc(WINSIZE);
+    p->dict_len = WINSIZE;
+    inflateGetDictionary(&r->strm, p->window, &p->dict_len);
+
+    p->row = malloc(r->have + 1);
+    memcpy(p->row, r->filtered, r->have);
+
+    p->prev_row = malloc(r->stride);
+    memcpy(p->prev_row, r->prev_row, r->stride);
+
+    r->next_point = r->y + index->span;
+}
+
+// record access points while reading, one at most every index->span rows
+void row_reader_record(RowReader *r, SeekIndex *index) {
+    r->index = index;
+    r->next_point = index->span;
+}
+
+// returns the next reconstructed row, NULL once all rows were handed out or
+// with r->error set if the data is broken. the row stays valid until the next
+// call
+uint8_t *row_reader_next(RowReader *r) {
+    if (r->y >= r->png->height || r->error)
+        return NULL;
+
+    size_t row_len = r->stride + 1; // + 1 for filter byte
+    int flush = r->index ? Z_BLOCK : Z_NO_FLUSH;
+
+    while (r->have < row_len) {
+        r->strm.next_out = r->filtered + r->have;
+        r->strm.avail_out = row_len - r->have;
+
+        int err = inflate(&r->strm, flush);
+        if (err != Z_OK && err != Z_STREAM_END) {
+            r->error = r->strm.msg ? r->strm.msg : "error with inflate";
+            return NULL;
+        }
+
+        r->have = row_len - r->strm.avail_out;
+
+        // stopped right after a block ended, and not in the last one
+        if (r->index && r->y >= r->next_point &&
+            (r->strm.data_type & 128) && !(r->strm.data_type & 64))
+            add_access_point(r);
+
+        if (err == Z_STREAM_END && r->have < row_len) {
+            r->error = "IDAT data ends before the last row";
+            return NULL;
+        }
+    }
+
+    kernels.recon_row(r->filtered[0], r->filtered + 1, r->prev_row,
+                      r->cur_row, r->stride, r->bpp);
+
+    uint8_t *row = r->cur_row;
+    r->cur_row = r->prev_row;
+    r->prev_row = row;
+
+    r->have = 0;
+    r->y++;
+
+    return row;
+}
+
+// after this row_reader_next() returns row y. rows between the closest
+// access point and y still have to be inflated
+void row_reader_seek(RowReader *r, SeekIndex *index, uint32_t y) {
+    AccessPoint *p = NULL;
+    for (uint32_t i = 0; index && i < index->count; i++) {
+        if (index->points[i].y > y)
+            break;
+        p = &index->points[i];
+    }
+
+    bool behind = p && (p->y > r->y || (p->y == r->y && p->have > r->have));
+
+    if (behind) {
+        inflateEnd(&r->strm);
+        memset(&r->strm, 0, sizeof(r->strm));
+        if (inflateInit2(&r->strm, -15) != Z_OK) // raw inflate
+            panic("error with inflate init");
+
+        if (p->bits)
+            inflatePrime(&r->strm, p->bits,
+                         r->png->data[p->in - 1] >> (8 - p->bits));
+        r->strm.next_in = r->png->data + p->in;
+        r->strm.avail_in = r->png->data_t - p->in;
+        inflateSetDictionary(&r->strm, p->window, p->dict_len);
+
+        memcpy(r->filtered, p->row, p->have);
+        memcpy(r->prev_row, p->prev_row, r->stride);
+        r->have = p->have;
+        r->y = p->y;
+    } else if (y < r->y) {
+        // no access point to go back to, start over
+        SeekIndex *recording = r->index;
+        row_reader_end(r);
+        row_reader_init(r, r->png);
+        if (recording)
+            row_reader_record(r, recording);
+    }
+
+    // a broken stream leaves r->error set and stops short of y
+    while (r->y < y)
+        if (!row_reader_next(r))
+            break;
+}
+
+void free_index(SeekIndex *index) {
+    for (uint32_t i = 0; i < index->count; i++) {
+        free(index->points[i].window);
+        free(index->points[i].row);
+        free(index->points[i].prev_row);
+    }
+    free(index->points);
+    memset(index, 0, sizeof(*index));
+}
+
+// the index only fits the exact data it was recorded on
+uint32_t idat_crc(PNG *png) {
+    return crc32_z(0, png->data, png->data_t);
+}
+
+void save_index(const char *path, PNG *png, SeekIndex *index) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("fopen");
+        return;
+    }
+
+    uint32_t stride = png_stride(png);
+    uint32_t header[] = {PIDX_MAGIC,   PIDX_VERSION, png->width,
+                         png->height,  stride,       index->span,
+                         index->count, idat_crc(png)};
+    uint64_t data_t = png->data_t;
+    fwrite(header, sizeof(header), 1, file);
+    fwrite(&data_t, sizeof(data_t), 1, file);
+
+    for (uint32_t i = 0; i < index->count; i++) {
+        AccessPoint *p = &index->points[i];
+        fwrite(&p->in, sizeof(p->in), 1, file);
+        fwrite(&p->out, sizeof(p->out), 1, file);
+        fwrite(&p->y, sizeof(p->y), 1, file);
+        fwrite(&p->have, sizeof(p->have), 1, file);
+        fwrite(&p->dict_len, sizeof(p->dict_len), 1, file);
+        fwrite(&p->bits, sizeof(p->bits), 1, file);
+        fwrite(p->window, CHAR, p->dict_len, file);
+        fwrite(p->row, CHAR, p->have, file);
+        fwrite(p->prev_row, CHAR, stride, file);
+    }
+
+    fclose(file);
+}
+
+// returns false if there is no index, it was made for some other png or any
+// point in it doesn't fit this one
+bool load_index(const char *path, PNG *png, SeekIndex *index) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+
+    uint32_t stride = png_stride(png);
+    uint32_t header[8];
+    uint64_t data_t;
+    if (fread(header, sizeof(header), 1, file) != 1 ||
+        fread(&data_t, sizeof(data_t), 1, file) != 1 ||
+        header[0] != PIDX_MAGIC || header[1] != PIDX_VERSION ||
+        header[2] != png->width || header[3] != png->height ||
+        header[4] != stride || data_t != png->data_t ||
+        header[7] != idat_crc(png)) {
+        fclose(file);
+        return false;
+    }
+
+    memset(index, 0, sizeof(*index));
+    index->span = header[5];
+    index->cap = header[6];
+    index->points = calloc(index->cap ? index->cap : 1, sizeof(AccessPoint));
+
+    for (uint32_t i = 0; i < header[6]; i++) {
+        AccessPoint *p = &index->points[i];
+        bool ok = fread(&p->in, sizeof(p->in), 1, file) &&
+                  fread(&p->out, sizeof(p->out), 1, file) &&
+                  fread(&p->y, sizeof(p->y), 1, file) &&
+                  fread(&p->have, sizeof(p->have), 1, file) &&
+                  fread(&p->dict_len, sizeof(p->dict_len), 1, file) &&
+                  fread(&p->bits, sizeof(p->bits), 1, file);
+        // in order, inside the image and the data, and the partial byte
+        // before in has to exist
+        bool fits = p->y < png->height && p->have <= stride + 1 &&
+                    p->dict_len <= WINSIZE && p->bits < 8 &&
+                    p->in <= data_t && (p->bits == 0 || p->in >= 1) &&
+                    (i == 0 || p->y >= index->points[i - 1].y);
+        if (!ok || !fits) {
+            fclose(file);
+            free_index(index);
+            return false;
+        }
+
+        p->window = malloc(p->dict_len + 1);
+        p->row = malloc(p->have + 1);
+        p->prev_row = malloc(stride);
+        index->count++;
+
+        if (fread(p->window, CHAR, p->dict_len, file) != p->dict_len ||
+            fread(p->row, CHAR, p->have, file) != p->have ||
+            fread(p->prev_row, CHAR, stride, file) != stride) {
+            fclose(file);
+            free_index(index);
+            return false;
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+// sample i of a row, msb first for bit depths below 8
+static inline uint32_t sample(uint8_t *row, size_t i, uint32_t depth) {
+    switch (depth) {
+    case 16:
+        return row[i * 2] << 8 | row[i * 2 + 1];
+    case 8:
+        return row[i];
+    default: {
+        size_t bit = i * depth;
+        uint32_t shift = 8 - depth - bit % 8;
+        return (row[bit / 8] >> shift) & ((1 << depth) - 1);
+    }
+    }
+}
+
+#define CONVERT_CHUNK 256 // pixels that go through a stack buffer at once
+
+// the generic path: one pixel at a time through sample(), as 16 bit values
+void convert_generic(PNG *png, uint8_t *row, uint32_t x, uint32_t count,
+                     OutputFormat format, uint8_t *dst) {
+    uint32_t depth = png->bit_depth;
+    uint32_t ch = channels(png->color_type);
+    uint32_t max = (1 << depth) - 1;
+    bool bgra = format == OUTPUT_BGRA8;
+
+    for (uint32_t i = 0; i < count; i++) {
+        size_t s = (size_t)(x + i) * ch;
+        uint32_t v[4] = {0};
+        for (uint32_t c = 0; c < ch; c++)
+            v[c] = sample(row, s + c, depth);
+
+        uint16_t out[4];
+        switch (png->color_type) {
+        case COLOR_INDEXED: {
+            uint8_t *p = v[0] < png->palette_size ? png->palette + v[0] * 4
+                                                  : (uint8_t[]){0, 0, 0, 255};
+            for (int c = 0; c < 4; c++)
+                out[c] = p[c] * 257;
+            break;
+        }
+        case COLOR_GRAYSCALE:
+        case COLOR_GRAYSCALE_ALPHA: {
+            bool clear = png->has_key && ch == 1 && v[0] == png->key[0];
+            out[0] = out[1] = out[2] = v[0] * 65535 / max;
+            out[3] = ch == 2 ? v[1] * 65535 / max : clear ? 0 : 65535;
+            break;
+        }
+        case COLOR_TRUE_RGB:
+        case COLOR_TRUEALPHA_RGBA: {
+            bool clear = png->has_key && ch == 3 && v[0] == png->key[0] &&
+                         v[1] == png->key[1] && v[2] == png->key[2];
+            for (int c = 0; c < 3; c++)
+                out[c] = v[c] * 65535 / max;
+            out[3] = ch == 4 ? v[3] * 65535 / max : clear ? 0 : 65535;
+            break;
+        }
+        default:
+            panic("Poder does not support color type");
+        }
+
+        if (format == OUTPUT_RGBA16) {
+            memcpy(dst + (size_t)i * 8, out, 8);
+            continue;
+        }
+        // 16 bit samples keep their high byte, v * 257 >> 8 is v
+        uint8_t *d = dst + (size_t)i * 4;
+        d[0] = out[bgra ? 2 : 0] >> 8;
+        d[1] = out[1] >> 8;
+        d[2] = out[bgra ? 0 : 2] >> 8;
+        d[3] = out[3] >> 8;
+    }
+}
+
+// 8 bit samples of the color type to RGBA8 or BGRA8
+void convert_8(uint32_t color_type, uint8_t *src, uint8_t *dst,
+               uint32_t count, bool bgra) {
+    ConvertFn *convert = kernels.convert;
+    switch (color_type) {
+    case COLOR_GRAYSCALE:
+        convert[CONVERT_GRAY_RGBA](src, dst, count);
+        break;
+    case COLOR_GRAYSCALE_ALPHA:
+        convert[CONVERT_GA_RGBA](src, dst, count);
+        break;
+    case COLOR_TRUE_RGB:
+        convert[bgra ? CONVERT_RGB_BGRA : CONVERT_RGB_RGBA](src, dst, count);
+        break;
+    case COLOR_TRUEALPHA_RGBA:
+        if (bgra)
+            convert[CONVERT_RGBA_BGRA](src, dst, count);
+        else
+            memcpy(dst, src, (size_t)count * 4);
+        break;
+    }
+}
+
+// converts count pixels of a reconstructed row, starting at pixel x, into
+// format. output_bpp(format) bytes per pixel go to dst
+void convert_row(PNG *png, uint8_t *row, uint32_t x, uint32_t count,
+                 OutputFormat format, uint8_t *dst) {
+    uint32_t depth = png->bit_depth;
+    uint32_t ch = channels(png->color_type);
+    if (png->color_type == COLOR_INDEXED || depth < 8 || png->has_key) {
+        convert_generic(png, row, x, count, format, dst);
+        return;
+    }
+
+    ConvertFn *convert = kernels.convert;
+    bool bgra = format == OUTPUT_BGRA8;
+    uint8_t *src = row + (size_t)x * ch * depth / 8;
+
+    if (depth == 8 && format != OUTPUT_RGBA16) {
+        convert_8(png->color_type, src, dst, count, bgra);
+        return;
+    }
+    if (depth == 16 && format == OUTPUT_RGBA16) {
+        if (ch == 4)
+            convert[CONVERT_SWAP16](src, dst, count * 4);
+        else
+            convert_generic(png, row, x, count, format, dst);
+        return;
+    }
+
+    // narrowed or widened through the stack a chunk at a time
+    uint8_t tmp[CONVERT_CHUNK * 4];
+    for (uint32_t i = 0; i < count; i += CONVERT_CHUNK) {
+        uint32_t n = count - i < CONVERT_CHUNK ? count - i : CONVERT_CHUNK;
+        if (depth == 16) {
+            convert[CONVERT_NARROW16](src + (size_t)i * ch * 2, tmp, n * ch);
+            convert_8(png->color_type, tmp, dst + (size_t)i * 4, n, bgra);
+        } else {
+            convert_8(png->color_type, src + (size_t)i * ch, tmp, n, false);
+            convert[CONVERT_WIDEN8](tmp, dst + (size_t)i * 8, n * 4);
+        }
+    }
+}
+
+// whether any pixel can come out less than opaque
+bool may_have_alpha(PNG *png) {
+    if (png->color_type == COLOR_INDEXED) {
+        for (uint32_t i = 0; i < png->palette_size; i++)
+            if (png->palette[i * 4 + 3] != 255)
+                return true;
+        return false;
+    }
+    return png->has_key || png->color_type == COLOR_GRAYSCALE_ALPHA ||
+           png->color_type == COLOR_TRUEALPHA_RGBA;
+}
+
+// premultiplies count converted pixels in place
+void premultiply_row(uint8_t *px, uint32_t count, OutputFormat format) {
+    Convert c =
+        format == OUTPUT_RGBA16 ? CONVERT_PREMULTIPLY16 : CONVERT_PREMULTIPLY8;
+    kernels.convert[c](px, px, count);
+}
+
+/*
+ * Color management
+ *
+ * gAMA, cHRM, sRGB and iCCP say how samples map to light, and decoding turns
+ * them into sRGB: a curve per channel to linear light, a 3x3 matrix when the
+ * primaries aren't sRGB's, then the sRGB curve back. without a matrix both
+ * curves fold into one table from sample to sample, 256 entries for 8 bit
+ * output and 65536 for 16 bit. iCCP is only understood for matrix/TRC
+ * profiles, the kind cameras and editors embed, LUT based ones fall back to
+ * gAMA and cHRM if there are any. transforms are cached by the contents of
+ * the chunks, so a folder of images with the same profile builds them once.
+ */
+
+// icc parametric curve type 4, x >= d ? (a * x + b)^g + e : c * x + f.
+// a table of count points instead if there is one
+typedef struct {
+    float g, a, b, c, d, e, f;
+    uint32_t count;
+    uint16_t *table;
+} Curve;
+
+#define CURVE_GAMMA(gamma) ((Curve){.g = gamma, .a = 1})
+#define CURVE_SRGB                                                             \
+    ((Curve){.g = 2.4f, .a = 1 / 1.055f, .b = 0.055f / 1.055f,                \
+             .c = 1 / 12.92f, .d = 0.04045f})
+
+float curve_eval(Curve *curve, float x) {
+    float y;
+    if (curve->count) {
+        float at = x * (curve->count - 1);
+        uint32_t i = at < curve->count - 1 ? (uint32_t)at : curve->count - 2;
+        float t = at - i;
+        y = (curve->table[i] * (1 - t) + curve->table[i + 1] * t) / 65535;
+    } else if (x >= curve->d) {
+        float base = curve->a * x + curve->b;
+        y = powf(base > 0 ? base : 0, curve->g) + curve->e;
+    } else {
+        y = curve->c * x + curve->f;
+    }
+    return y < 0 ? 0 : y > 1 ? 1 : y;
+}
+
+float srgb_encode(float linear) {
+    return linear <= 0.0031308f ? linear * 12.92f
+                                : 1.055f * powf(linear, 1 / 2.4f) - 0.055f;
+}
+
+// row major 3x3 matrices
+void mat3_mul(float *a, float *b, float *out) {
+    float m[9];
+    for (int r = 0; r < 3; r++)
+        for (int c = 0; c < 3; c++)
+            m[r * 3 + c] = a[r * 3] * b[c] + a[r * 3 + 1] * b[3 + c] +
+                           a[r * 3 + 2] * b[6 + c];
+    memcpy(out, m, sizeof(m));
+}
+
+bool mat3_invert(float *a, float *out) {
+    float m[9] = {
+        a[4] * a[8] - a[5] * a[7], a[2] * a[7] - a[1] * a[8],
+        a[1] * a[5] - a[2] * a[4], a[5] * a[6] - a[3] * a[8],
+        a[0] * a[8] - a[2] * a[6], a[2] * a[3] - a[0] * a[5],
+        a[3] * a[7] - a[4] * a[6], a[1] * a[6] - a[0] * a[7],
+        a[0] * a[4] - a[1] * a[3],
+    };
+    float det = a[0] * m[0] + a[1] * m[3] + a[2] * m[6];
+    if (fabsf(det) < 1e-9f)
+        return false;
+    for (int i = 0; i < 9; i++)
+        out[i] = m[i] / det;
+    return true;
+}
+
+// the sRGB primaries adapted to D50, the white of the icc connection space
+float srgb_to_xyz[9] = {0.4360747f, 0.3850649f, 0.1430804f,
+                        0.2225045f, 0.7168786f, 0.0606169f,
+                        0.0139322f, 0.0971045f, 0.7141733f};
+float d50[3] = {0.9642f, 1.0f, 0.8249f};
+
+// rgb to D50 XYZ from cHRM, bradford adapted from its white point
+bool chrm_to_xyz(uint32_t *chrm, float *out) {
+    float xy[8];
+    for (int i = 0; i < 8; i++)
+        xy[i] = chrm[i] / 100000.f;
+    for (int i = 0; i < 4; i++)
+        if (xy[i * 2 + 1] <= 0)
+            return false;
+
+    // columns are the primaries with Y = 1, scaled so they add up to white
+    float p[9], inv[9], white[3];
+    for (int i = 0; i < 3; i++) {
+        float x = xy[2 + i * 2], y = xy[3 + i * 2];
+        p[i] = x / y, p[3 + i] = 1, p[6 + i] = (1 - x - y) / y;
+    }
+    white[0] = xy[0] / xy[1], white[1] = 1;
+    white[2] = (1 - xy[0] - xy[1]) / xy[1];
+    if (!mat3_invert(p, inv))
+        return false;
+    for (int i = 0; i < 3; i++) {
+        float s = inv[i * 3] * white[0] + inv[i * 3 + 1] * white[1] +
+                  inv[i * 3 + 2] * white[2];
+        for (int r = 0; r < 3; r++)
+            p[r * 3 + i] *= s;
+    }
+
+    float bradford[9] = {0.8951f,  0.2664f, -0.1614f, -0.7502f, 1.7135f,
+                         0.0367f,  0.0389f, -0.0685f, 1.0296f};
+    float scale[9] = {0}, adapt[9];
+    for (int i = 0; i < 3; i++) {
+        float *row = bradford + i * 3;
+        float from = row[0] * white[0] + row[1] * white[1] + row[2] * white[2];
+        float to = row[0] * d50[0] + row[1] * d50[1] + row[2] * d50[2];
+        scale[i * 4] = to / from;
+    }
+    mat3_invert(bradford, adapt);
+    mat3_mul(adapt, scale, adapt);
+    mat3_mul(adapt, bradford, adapt);
+    mat3_mul(adapt, p, out);
+    return true;
+}
+
+// tag data by signature, NULL if it's missing or doesn't fit
+uint8_t *icc_tag(uint8_t *icc, size_t size, const char *sig, uint32_t *len) {
+    uint32_t count = convert_uint(icc + 128);
+    for (uint32_t i = 0; i < count && 132 + (i + 1) * 12 <= size; i++) {
+        uint8_t *entry = icc + 132 + i * 12;
+        uint32_t offset = convert_uint(entry + 4);
+        *len = convert_uint(entry + 8);
+        if (memcmp(entry, sig, 4) == 0 && offset <= size &&
+            *len <= size - offset && *len >= 12)
+            return icc + offset;
+    }
+    return NULL;
+}
+
+float s15f16(uint8_t *p) { return (int32_t)convert_uint(p) / 65536.f; }
+
+// curv or para, the table gets allocated
+bool icc_curve(uint8_t *icc, size_t size, const char *sig, Curve *curve) {
+    uint32_t len;
+    uint8_t *tag = icc_tag(icc, size, sig, &len);
+    if (!tag)
+        return false;
+
+    if (memcmp(tag, "curv", 4) == 0) {
+        uint32_t count = convert_uint(tag + 8);
+        if (count > (len - 12) / 2)
+            return false;
+        if (count == 0) {
+            *curve = CURVE_GAMMA(1);
+        } else if (count == 1) {
+            *curve = CURVE_GAMMA(tag[12] + tag[13] / 256.f);
+        } else {
+            *curve = (Curve){.count = count};
+            curve->table = malloc(count * sizeof(uint16_t));
+            for (uint32_t i = 0; i < count; i++)
+                curve->table[i] = tag[12 + i * 2] << 8 | tag[13 + i * 2];
+        }
+        return true;
+    }
+
+    // the other types are type 4 with some parameters left out
+    static const uint32_t params[] = {1, 3, 4, 5, 7};
+    uint32_t type = tag[8] << 8 | tag[9];
+    if (memcmp(tag, "para", 4) != 0 || type > 4 ||
+        len < 12 + params[type] * 4)
+        return false;
+    float v[7] = {0};
+    for (uint32_t i = 0; i < params[type]; i++)
+        v[i] = s15f16(tag + 12 + i * 4);
+
+    *curve = (Curve){.g = v[0], .a = 1};
+    if (type > 0) {
+        if (v[1] == 0)
+            return false;
+        curve->a = v[1], curve->b = v[2], curve->d = -v[2] / v[1];
+    }
+    if (type == 2)
+        curve->e = curve->f = v[3];
+    if (type >= 3)
+        curve->c = v[3], curve->d = v[4];
+    if (type == 4)
+        curve->e = v[5], curve->f = v[6];
+    return true;
+}
+
+bool icc_xyz(uint8_t *icc, size_t size, const char *sig, float *xyz) {
+    uint32_t len;
+    uint8_t *tag = icc_tag(icc, size, sig, &len);
+    if (!tag || len < 20 || memcmp(tag, "XYZ ", 4) != 0)
+        return false;
+    for (int i = 0; i < 3; i++)
+        xyz[i] = s15f16(tag + 8 + i * 4);
+    return true;
+}
+
+// inflates and reads a matrix/TRC profile, gray ones only have a curve
+bool parse_icc(PNG *png, Curve *curves, float *to_xyz, bool *matrix) {
+    uint8_t header[132];
+    if (zinflate(png->icc, header, png->icc_t, sizeof(header), true) <
+        sizeof(header))
+        return false;
+    uint32_t size = convert_uint(header);
+    if (size < sizeof(header) || size > (64 << 20))
+        return false;
+
+    uint8_t *icc = malloc(size);
+    bool ok = zinflate(png->icc, icc, png->icc_t, size, false) == size &&
+              memcmp(icc + 20, "XYZ ", 4) == 0;
+    *matrix = false;
+    memset(curves, 0, 3 * sizeof(Curve));
+    if (ok && memcmp(icc + 16, "GRAY", 4) == 0) {
+        ok = icc_curve(icc, size, "kTRC", &curves[0]);
+        curves[1] = curves[2] = curves[0];
+    } else if (ok && memcmp(icc + 16, "RGB ", 4) == 0) {
+        const char *trc[] = {"rTRC", "gTRC", "bTRC"};
+        const char *col[] = {"rXYZ", "gXYZ", "bXYZ"};
+        for (int c = 0; c < 3 && ok; c++) {
+            float xyz[3];
+            ok = icc_xyz(icc, size, col[c], xyz) &&
+                 icc_curve(icc, size, trc[c], &curves[c]);
+            for (int r = 0; r < 3; r++)
+                to_xyz[r * 3 + c] = xyz[r];
+        }
+        *matrix = ok;
+        if (!ok)
+            for (int c = 0; c < 3; c++)
+                free(curves[c].table);
+    } else {
+        ok = false;
+    }
+    free(icc);
+    return ok;
+}
+
+typedef struct {
+    uint64_t key;     // hash of the color chunks and the kind of output
+    uint32_t refs;    // decodes using it, plus one while it's cached
+    bool none;        // sRGB already, cached so the chunks aren't parsed again
+    bool wide;        // 65536 entries per table instead of 256
+    bool matrix;      // linear and m instead of lut
+    float m[9];       // linear rgb to linear sRGB
+    uint16_t *lut[3]; // by sample, to the sRGB sample
+    float *linear[3]; // by sample, to linear light times 65535
+} ColorTransform;
+
+#define COLOR_CACHE 8
+
+ColorTransform *color_cache[COLOR_CACHE];
+uint32_t color_cache_next = 0;
+pthread_mutex_t color_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// linear light to sRGB, by linear * 65535
+uint8_t linear_to_srgb8[65536];
+uint16_t linear_to_srgb16[65536];
+pthread_once_t srgb_encode_once = PTHREAD_ONCE_INIT;
+
+void init_srgb_encode(void) {
+    for (int i = 0; i < 65536; i++) {
+        float c = srgb_encode(i / 65535.f);
+        linear_to_srgb8[i] = lrintf(c * 255);
+        linear_to_srgb16[i] = lrintf(c * 65535);
+    }
+}
+
+uint64_t color_key(PNG *png, bool gray, bool wide) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    uint32_t fields[] = {png->srgb, png->gamma, png->has_chrm, gray, wide};
+    uint8_t *parts[] = {(uint8_t *)fields, (uint8_t *)png->chrm, png->icc};
+    size_t sizes[] = {sizeof(fields), sizeof(png->chrm), png->icc_t};
+    for (int p = 0; p < 3; p++)
+        for (size_t i = 0; i < sizes[p]; i++)
+            hash = (hash ^ parts[p][i]) * 0x100000001b3ull;
+    return hash;
+}
+
+void build_color(ColorTransform *t, PNG *png, bool gray) {
+    Curve curves[3];
+    float to_xyz[9];
+    bool matrix = false;
+
+    // iCCP comes first, then sRGB, then gAMA and cHRM
+    bool icc = png->icc && parse_icc(png, curves, to_xyz, &matrix);
+    if (!icc && (png->srgb || (!png->gamma && !png->has_chrm))) {
+        t->none = true;
+        return;
+    }
+    if (!icc) {
+        curves[0] = png->gamma ? CURVE_GAMMA(100000.f / png->gamma)
+                               : CURVE_SRGB;
+        curves[1] = curves[2] = curves[0];
+        matrix = png->has_chrm && chrm_to_xyz(png->chrm, to_xyz);
+    }
+
+    // primaries within a rounding error of sRGB's don't need the matrix
+    float from_xyz[9];
+    if (matrix && !gray && mat3_invert(srgb_to_xyz, from_xyz)) {
+        mat3_mul(from_xyz, to_xyz, t->m);
+        t->matrix = false;
+        for (int i = 0; i < 9; i++)
+            if (fabsf(t->m[i] - (i % 4 == 0)) > 0.002f)
+                t->matrix = true;
+    }
+
+    // float keeps the shadows of 16 bit samples from rounding to black
+    uint32_t n = t->wide ? 65536 : 256;
+    bool identity = !t->matrix;
+    for (int c = 0; c < 3; c++) {
+        if (t->matrix)
+            t->linear[c] = malloc(n * sizeof(float));
+        else
+            t->lut[c] = malloc(n * sizeof(uint16_t));
+        for (uint32_t i = 0; i < n; i++) {
+            float linear = curve_eval(&curves[c], i / (float)(n - 1));
+            if (t->matrix) {
+                t->linear[c][i] = linear * 65535;
+                continue;
+            }
+            t->lut[c][i] = lrintf(srgb_encode(linear) * (n - 1));
+            identity &= t->lut[c][i] == i;
+        }
+    }
+    for (int c = 0; c < 3; c++)
+        if (c == 0 || curves[c].table != curves[0].table)
+            free(curves[c].table); // gray profiles share theirs
+
+    // sRGB in all but name
+    if (identity) {
+        for (int c = 0; c < 3; c++)
+            free(t->lut[c]), t->lut[c] = NULL;
+        t->none = true;
+    }
+}
+
+// with color_cache_lock held
+void color_unref(ColorTransform *t) {
+    if (--t->refs > 0)
+        return;
+    for (int c = 0; c < 3; c++)
+        free(t->lut[c]), free(t->linear[c]);
+    free(t);
+}
+
+// the transform from png to sRGB for output in format, NULL if the samples
+// are sRGB already. color_put() it when done
+ColorTransform *color_get(PNG *png, OutputFormat format) {
+    if (!png->icc && (png->srgb || (!png->gamma && !png->has_chrm)))
+        return NULL;
+
+    bool gray = png->color_type == COLOR_GRAYSCALE ||
+                png->color_type == COLOR_GRAYSCALE_ALPHA;
+    bool wide = format == OUTPUT_RGBA16;
+    uint64_t key = color_key(png, gray, wide);
+
+    pthread_mutex_lock(&color_cache_lock);
+    for (int i = 0; i < COLOR_CACHE; i++) {
+        ColorTransform *t = color_cache[i];
+        if (t && t->key == key) {
+            t = t->none ? NULL : t;
+            if (t)
+                t->refs++;
+            pthread_mutex_unlock(&color_cache_lock);
+            return t;
+        }
+    }
+    pthread_mutex_unlock(&color_cache_lock);
+
+    // built without the lock, two decodes might both build the same one
+    pthread_once(&srgb_encode_once, init_srgb_encode);
+    ColorTransform *t = calloc(1, sizeof(ColorTransform));
+    t->key = key;
+    t->wide = wide;
+    build_color(t, png, gray);
+
+    // replace the oldest one, it goes once the decodes using it are done
+    pthread_mutex_lock(&color_cache_lock);
+    ColorTransform **slot = &color_cache[color_cache_next];
+    color_cache_next = (color_cache_next + 1) % COLOR_CACHE;
+    if (*slot)
+        color_unref(*slot);
+    *slot = t;
+    t->refs = t->none ? 1 : 2;
+    pthread_mutex_unlock(&color_cache_lock);
+    return t->none ? NULL : t;
+}
+
+void color_put(ColorTransform *t) {
+    if (!t)
+        return;
+    pthread_mutex_lock(&color_cache_lock);
+    color_unref(t);
+    pthread_mutex_unlock(&color_cache_lock);
+}
+
+// linear rgb times a row of the matrix, back to 0..65535
+static inline uint16_t color_mix(float *m, float r, float g, float b) {
+    float v = m[0] * r + m[1] * g + m[2] * b + 0.5f;
+    return v < 0 ? 0 : v > 65535 ? 65535 : (uint16_t)v;
+}
+
+// in place on count converted pixels, alpha stays as it is
+void color_row(ColorTransform *t, uint8_t *px, uint32_t count,
+               OutputFormat format) {
+    // copies, byte stores could alias the pointers in t otherwise
+    uint16_t *lut[3] = {t->lut[0], t->lut[1], t->lut[2]};
+    float *linear[3] = {t->linear[0], t->linear[1], t->linear[2]};
+    float m[9];
+    memcpy(m, t->m, sizeof(m));
+    int r = format == OUTPUT_BGRA8 ? 2 : 0, b = 2 - r;
+
+    if (format == OUTPUT_RGBA16) {
+        for (uint32_t i = 0; i < count; i++, px += 8) {
+            uint16_t v[4];
+            memcpy(v, px, 8);
+            if (t->matrix) {
+                float lr = linear[0][v[0]], lg = linear[1][v[1]],
+                      lb = linear[2][v[2]];
+                for (int c = 0; c < 3; c++)
+                    v[c] = linear_to_srgb16[color_mix(m + c * 3, lr, lg, lb)];
+            } else {
+                for (int c = 0; c < 3; c++)
+                    v[c] = lut[c][v[c]];
+            }
+            memcpy(px, v, 8);
+        }
+        return;
+    }
+
+    if (!t->matrix) {
+        for (uint32_t i = 0; i < count; i++, px += 4) {
+            uint8_t vr = px[r], vg = px[1], vb = px[b];
+            px[r] = lut[0][vr];
+            px[1] = lut[1][vg];
+            px[b] = lut[2][vb];
+        }
+        return;
+    }
+    for (uint32_t i = 0; i < count; i++, px += 4) {
+        float lr = linear[0][px[r]], lg = linear[1][px[1]],
+              lb = linear[2][px[b]];
+        uint8_t vr = linear_to_srgb8[color_mix(m, lr, lg, lb)];
+        uint8_t vg = linear_to_srgb8[color_mix(m + 3, lr, lg, lb)];
+        uint8_t vb = linear_to_srgb8[color_mix(m + 6, lr, lg, lb)];
+        px[r] = vr, px[1] = vg, px[b] = vb;
+    }
+}
+
+/*
+ * Downscale on decode
+ *
+ * Rows are summed into a column accumulator as they come out of recon, and
+ * every `scale` rows the accumulator is folded horizontally into one output
+ * row. So only one output row and one accumulator row ever exist instead of
+ * the full size image. 8 * 8 * 255 still fits in 16 bits.
+ */
+
+// acc[i] += rgba[i]
+void box_accumulate(uint16_t *acc, uint8_t *rgba, uint32_t n) {
+    uint32_t i = 0;
+#ifdef __SSE2__
+    if (kernels.isa >= ISA_SSE2) {
+        __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            __m128i px = _mm_loadu_si128((__m128i *)(rgba + i));
+            __m128i lo = _mm_loadu_si128((__m128i *)(acc + i));
+            __m128i hi = _mm_loadu_si128((__m128i *)(acc + i + 8));
+            lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(px, zero));
+            hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(px, zero));
+            _mm_storeu_si128((__m128i *)(acc + i), lo);
+            _mm_storeu_si128((__m128i *)(acc + i + 8), hi);
+        }
+    }
+#endif
+    for (; i < n; i++)
+        acc[i] += rgba[i];
+}
+
+// averages scale x rows blocks of acc into width / scale rgba pixels
+void box_resolve(uint16_t *acc, uint8_t *dst, uint32_t width, uint32_t scale,
+                 uint32_t rows) {
+    uint32_t out_width = (width + scale - 1) / scale;
+    uint32_t x = 0;
+
+#ifdef __SSE2__
+    // full blocks have a power of two area, so shift instead of divide
+    if (kernels.isa >= ISA_SSE2 && rows == scale && scale > 1) {
+        uint32_t shift = __builtin_ctz(scale * scale);
+        __m128i round = _mm_set1_epi16(1 << (shift - 1));
+        __m128i sh = _mm_cvtsi32_si128(shift);
+        for (; (x + 2) * scale <= width; x += 2) {
+            uint16_t *a = acc + x * scale * 4;
+            __m128i sum = _mm_setzero_si128();
+            for (uint32_t k = 0; k < scale; k++) {
+                // pixel k of both output pixels next to each other
+                __m128i p0 = _mm_loadl_epi64((__m128i *)(a + k * 4));
+                __m128i p1 = _mm_loadl_epi64((__m128i *)(a + (scale + k) * 4));
+                sum = _mm_add_epi16(sum, _mm_unpacklo_epi64(p0, p1));
+            }
+            sum = _mm_srl_epi16(_mm_add_epi16(sum, round), sh);
+            sum = _mm_packus_epi16(sum, sum);
+            _mm_storel_epi64((__m128i *)(dst + x * 4), sum);
+        }
+    }
+#endif
+
+    for (; x < out_width; x++) {
+        uint32_t first = x * scale;
+        uint32_t last = first + scale < width ? first + scale : width;
+        uint32_t n = (last - first) * rows;
+        for (int c = 0; c < 4; c++) {
+            uint32_t sum = 0;
+            for (uint32_t i = first; i < last; i++)
+                sum += acc[i * 4 + c];
+            dst[x * 4 + c] = (sum + n / 2) / n;
+        }
+    }
+}
+
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} Region;
+
+typedef struct {
+    Region region;     // part of the image to decode, zero width means all
+    uint32_t scale;    // 1, 2, 4 or 8, box filtered while decoding
+    SeekIndex *seek;   // access points to start from, can be NULL
+    SeekIndex *record; // access points get recorded into this, can be NULL
+    void *pixels;          // decode into this instead of a new buffer
+    size_t stride;         // bytes between rows of pixels, 0 is packed
+    OutputFormat format;   // pixel layout of the output, rgba8 by default
+    bool premultiply;      // color multiplied by alpha, before any scaling
+    bool raw_color;        // samples as they are, without gAMA, iCCP and co
+    atomic_uint *progress; // output rows done so far get stored here
+    atomic_bool *cancel;   // stops the decode early when set
+    char *err;             // broken data fails with a message in here,
+    size_t errlen;         // without it decode_png() panics
+} DecodeOptions;
+
+// a decode_png() that can't go on, the returned image has no data
+Image decode_error(DecodeOptions *opts, const char *message) {
+    if (!opts->err)
+        panic(message);
+    snprintf(opts->err, opts->errlen, "%s", message);
+    return (Image){0};
+}
+
+// decodes opts->region of the png into an image of just that size divided by
+// opts->scale. rows below the region are not inflated at all, unless an index
+// is recorded. the rows above it still are, unless opts->seek has an access
+// point at or above the region to start from
+Image decode_png(PNG *png, DecodeOptions *opts) {
+    Region region = opts->region;
+    if (region.width == 0 || region.height == 0)
+        region = (Region){0, 0, png->width, png->height};
+
+    if (region.x >= png->width || region.y >= png->height)
+        return decode_error(opts, "region is outside of the image");
+    if (region.width > png->width - region.x)
+        region.width = png->width - region.x;
+    if (region.height > png->height - region.y)
+        region.height = png->height - region.y;
+
+    if (png->interlace)
+        return decode_error(opts, "interlaced PNGs are not supported");
+    if (!valid_depth(png->color_type, png->bit_depth))
+        return decode_error(opts, "unsupported color type or bit depth");
+
+    uint32_t scale = opts->scale ? opts->scale : 1;
+    if (scale != 1 && scale != 2 && scale != 4 && scale != 8)
+        panic("Scale has to be 1, 2, 4 or 8");
+
+    // the box filter works on 8 bit channels, the order does not matter
+    OutputFormat format = opts->format;
+    if (format == OUTPUT_RGBA16 && scale != 1)
+        panic("16 bit output can not be scaled");
+    uint32_t bpp = output_bpp(format);
+    bool premultiply = opts->premultiply && may_have_alpha(png);
+    ColorTransform *color = opts->raw_color ? NULL : color_get(png, format);
+
+    uint32_t out_width = (region.width + scale - 1) / scale;
+    uint32_t out_height = (region.height + scale - 1) / scale;
+
+    // uncompress IDAT chunks and apply filtering row by row
+    RowReader reader;
+    row_reader_init(&reader, png);
+    if (opts->record)
+        row_reader_record(&reader, opts->record);
+
+    row_reader_seek(&reader, opts->seek, region.y);
+    if (reader.error) {
+        const char *error = reader.error;
+        row_reader_end(&reader);
+        return decode_error(opts, error);
+    }
+
+    // raylib has no bgra format, those bytes are only for the caller
+    Image image = {
+        .data = opts->pixels ? opts->pixels
+                             : malloc((size_t)out_width * out_height * bpp),
+        .width = out_width,
+        .height = out_height,
+        .mipmaps = 1,
+        .format = format == OUTPUT_RGBA16
+                      ? PIXELFORMAT_UNCOMPRESSED_R16G16B16A16
+                      : PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+    uint8_t *dst = image.data;
+    size_t stride = opts->stride ? opts->stride : (size_t)out_width * bpp;
+
+    uint8_t *rgba = NULL;
+    uint16_t *acc = NULL;
+    if (scale > 1) {
+        rgba = malloc(region.width * 4);
+        acc = calloc(region.width * 4, sizeof(uint16_t));
+    }
+
+    for (uint32_t j = 0; j < region.height; j++) {
+        if (opts->cancel && atomic_load(opts->cancel))
+            break;
+
+        uint8_t *raw = row_reader_next(&reader);
+        if (!raw)
+            break;
+
+        if (scale == 1) {
+            convert_row(png, raw, region.x, region.width, format, dst);
+            if (color)
+                color_row(color, dst, region.width, format);
+            if (premultiply)
+                premultiply_row(dst, region.width, format);
+            dst += stride;
+            if (opts->progress)
+                atomic_store(opts->progress, j + 1);
+            continue;
+        }
+
+        convert_row(png, raw, region.x, region.width, format, rgba);
+        if (color)
+            color_row(color, rgba, region.width, format);
+        if (premultiply)
+            premultiply_row(rgba, region.width, format);
+        box_accumulate(acc, rgba, region.width * 4);
+
+        uint32_t rows = j % scale + 1;
+        if (rows == scale || j == region.height - 1) {
+            box_resolve(acc, dst, region.width, scale, rows);
+            memset(acc, 0, region.width * 4 * sizeof(uint16_t));
+            dst += stride;
+            if (opts->progress)
+                atomic_store(opts->progress, j / scale + 1);
+        }
+    }
+
+    // the index has to cover the whole image
+    if (opts->record)
+        while (row_reader_next(&reader))
+            ;
+
+    const char *error = reader.error;
+    row_reader_end(&reader);
+    color_put(color);
+    free(rgba);
+    free(acc);
+
+    if (error) {
+        if (!opts->pixels)
+            free(image.data);
+        return decode_error(opts, error);
+    }
+    return image;
+}
+
+/*
+ * Threads
+ *
+ * parallel_for() splits [0, count) into chunks that all cores pull from until
+ * none are left, the calling thread works too and it returns once every chunk
+ * is done.
+ */
+
+typedef void (*JobFn)(void *arg, uint32_t first, uint32_t last);
+
+typedef struct {
+    JobFn fn;
+    void *arg;
+    uint32_t count;
+    uint32_t chunk;
+    atomic_uint next;
+} Job;
+
+uint32_t cpu_count(void) {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? n : 1;
+}
+
+// parallel_for() called from a job runs on the calling thread
+__thread bool in_parallel_for = false;
+
+void *job_worker(void *p) {
+    Job *job = p;
+    in_parallel_for = true;
+    while (true) {
+        uint32_t first = atomic_fetch_add(&job->next, job->chunk);
+        if (first >= job->count)
+            break;
+
+        uint32_t last = job->count - first < job->chunk ? job->count
+                                                        : first + job->chunk;
+        job->fn(job->arg, first, last);
+    }
+    return NULL;
+}
+
+void parallel_for(uint32_t count, uint32_t chunk, JobFn fn, void *arg) {
+    if (in_parallel_for) {
+        fn(arg, 0, count);
+        return;
+    }
+    if (chunk == 0)
+        chunk = 1;
+
+    Job job = {.fn = fn, .arg = arg, .count = count, .chunk = chunk};
+    atomic_init(&job.next, 0);
+
+    uint32_t threads = cpu_count();
+    if (threads > (count + chunk - 1) / chunk)
+        threads = (count + chunk - 1) / chunk;
+
+    pthread_t workers[threads > 1 ? threads - 1 : 1];
+    uint32_t started = 0;
+    for (; started + 1 < threads; started++)
+        if (pthread_create(&workers[started], NULL, job_worker, &job) != 0)
+            break; // whoever is running picks up the rest
+
+    job_worker(&job);
+    in_parallel_for = false;
+
+    for (uint32_t i = 0; i < started; i++)
+        pthread_join(workers[i], NULL);
+}
+
+/*
+ * Resize
+ *
+ * Separable resampling of rgba images: every row is resized horizontally into
+ * a float buffer and then every output row is a weighted sum of taps rows of
+ * that. Each output pixel (or row) uses the same number of taps so the weight
+ * tables are plain arrays, and they are kept around per (src, dst, filter)
+ * since a batch usually resizes lots of images to the same size.
+ */
+
+typedef enum { FILTER_BICUBIC, FILTER_LANCZOS3 } ResizeFilter;
+
+typedef struct {
+    uint32_t src;
+    uint32_t dst;
+    ResizeFilter filter;
+
+    uint32_t taps;
+    uint32_t *start; // first source pixel of each destination pixel
+    float *weights;  // taps weights per destination pixel
+    uint32_t refs;   // resizes using it, plus one while it's cached
+} Weights;
+
+#define WEIGHT_CACHE 8
+
+Weights *weight_cache[WEIGHT_CACHE];
+uint32_t weight_cache_next = 0;
+pthread_mutex_t weight_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+float filter_kernel(ResizeFilter filter, float x) {
+    x = fabsf(x);
+    if (filter == FILTER_BICUBIC) {
+        // catmull-rom, a = -0.5
+        if (x < 1.f)
+            return 1.5f * x * x * x - 2.5f * x * x + 1.f;
+        if (x < 2.f)
+            return -0.5f * x * x * x + 2.5f * x * x - 4.f * x + 2.f;
+        return 0.f;
+    }
+
+    if (x < 1e-6f)
+        return 1.f;
+    if (x >= 3.f)
+        return 0.f;
+    float px = PI * x;
+    return 3.f * sinf(px) * sinf(px / 3.f) / (px * px);
+}
+
+// call with weight_cache_lock held
+void weights_unref(Weights *w) {
+    if (--w->refs > 0)
+        return;
+    free(w->start);
+    free(w->weights);
+    free(w);
+}
+
+// weights to resize src pixels to dst, weights_put() them when done
+Weights *get_weights(uint32_t src, uint32_t dst, ResizeFilter filter) {
+    pthread_mutex_lock(&weight_cache_lock);
+    for (int i = 0; i < WEIGHT_CACHE; i++) {
+        Weights *w = weight_cache[i];
+        if (w && w->src == src && w->dst == dst && w->filter == filter) {
+            w->refs++;
+            pthread_mutex_unlock(&weight_cache_lock);
+            return w;
+        }
+    }
+    pthread_mutex_unlock(&weight_cache_lock);
+
+    // built without the lock, two resizes might both build the same one
+    float ratio = (float)src / dst;
+    float radius = filter == FILTER_BICUBIC ? 2.f : 3.f;
+    float stretch = ratio > 1.f ? ratio : 1.f; // widen the kernel to downscale
+    float support = radius * stretch;
+
+    uint32_t taps = (uint32_t)ceilf(support) * 2 + 1;
+    if (taps > src)
+        taps = src;
+
+    Weights *w = calloc(1, sizeof(Weights));
+    w->src = src;
+    w->dst = dst;
+    w->filter = filter;
+    w->taps = taps;
+    w->start = malloc(dst * sizeof(uint32_t));
+    w->weights = malloc(dst * taps * sizeof(float));
+
+    for (uint32_t x = 0; x < dst; x++) {
+        float center = (x + 0.5f) * ratio;
+        int start = (int)ceilf(center - support - 0.5f);
+        if (start > (int)(src - taps))
+            start = src - taps;
+        if (start < 0)
+            start = 0;
+
+        float *weights = w->weights + x * taps;
+        float sum = 0.f;
+        for (uint32_t k = 0; k < taps; k++) {
+            weights[k] =
+                filter_kernel(filter, (start + k + 0.5f - center) / stretch);
+            sum += weights[k];
+        }
+        for (uint32_t k = 0; k < taps; k++)
+            weights[k] /= sum;
+
+        w->start[x] = start;
+    }
+
+    // replace the oldest one, it goes once the resizes using it are done
+    pthread_mutex_lock(&weight_cache_lock);
+    Weights **slot = &weight_cache[weight_cache_next];
+    weight_cache_next = (weight_cache_next + 1) % WEIGHT_CACHE;
+    if (*slot)
+        weights_unref(*slot);
+    *slot = w;
+    w->refs = 2;
+    pthread_mutex_unlock(&weight_cache_lock);
+    return w;
+}
+
+void weights_put(Weights *w) {
+    pthread_mutex_lock(&weight_cache_lock);
+    weights_unref(w);
+    pthread_mutex_unlock(&weight_cache_lock);
+}
+
+typedef struct {
+    uint8_t *src;
+    uint32_t src_width;
+    float *tmp; // src height rows of dst width float pixels
+    uint8_t *dst;
+    uint32_t dst_width;
+    Weights *horizontal;
+    Weights *vertical;
+} Resize;
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("avx2,fma"))) void
+resize_row_h_avx2(uint8_t *src, float *out, Weights *w) {
+    uint32_t taps = w->taps;
+    for (uint32_t x = 0; x < w->dst; x++) {
+        uint8_t *px = src + w->start[x] * 4;
+        float *weights = w->weights + x * taps;
+
+        // two taps per register, one in each half
+        __m256 acc = _mm256_setzero_ps();
+        uint32_t k = 0;
+        for (; k + 2 <= taps; k += 2) {
+            __m256 p = _mm256_cvtepi32_ps(
+                _mm256_cvtepu8_epi32(_mm_loadl_epi64((__m128i *)(px + k * 4))));
+            __m256 wk = _mm256_set_m128(_mm_set1_ps(weights[k + 1]),
+                                        _mm_set1_ps(weights[k]));
+            acc = _mm256_fmadd_ps(p, wk, acc);
+        }
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+                                _mm256_extractf128_ps(acc, 1));
+        if (k < taps) {
+            uint32_t last;
+            memcpy(&last, px + k * 4, 4);
+            __m128 p = _mm_cvtepi32_ps(
+                _mm_cvtepu8_epi32(_mm_cvtsi32_si128((int)last)));
+            sum = _mm_fmadd_ps(p, _mm_set1_ps(weights[k]), sum);
+        }
+        _mm_storeu_ps(out + x * 4, sum);
+    }
+}
+
+__attribute__((target("avx2,fma"))) void
+resize_row_v_avx2(float *tmp, uint8_t *out, uint32_t width, uint32_t start,
+                  float *weights, uint32_t taps) {
+    uint32_t n = width * 4;
+    uint32_t stride = width * 4;
+    uint32_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 acc = _mm256_setzero_ps();
+        for (uint32_t k = 0; k < taps; k++)
+            acc = _mm256_fmadd_ps(
+                _mm256_loadu_ps(tmp + (size_t)(start + k) * stride + i),
+                _mm256_set1_ps(weights[k]), acc);
+
+        __m256i v = _mm256_cvtps_epi32(acc); // rounds to nearest
+        __m128i v16 = _mm_packs_epi32(_mm256_castsi256_si128(v),
+                                      _mm256_extracti128_si256(v, 1));
+        _mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(v16, v16));
+    }
+    for (; i < n; i++) {
+        float acc = 0.f;
+        for (uint32_t k = 0; k < taps; k++)
+            acc += tmp[(size_t)(start + k) * stride + i] * weights[k];
+        out[i] = acc <= 0.f ? 0 : acc >= 255.f ? 255 : (uint8_t)(acc + 0.5f);
+    }
+}
+#endif
+
+void resize_row_h(uint8_t *src, float *out, Weights *w) {
+    for (uint32_t x = 0; x < w->dst; x++) {
+        uint8_t *px = src + w->start[x] * 4;
+        float *weights = w->weights + x * w->taps;
+        float acc[4] = {0};
+        for (uint32_t k = 0; k < w->taps; k++)
+            for (int c = 0; c < 4; c++)
+                acc[c] += px[k * 4 + c] * weights[k];
+        memcpy(out + x * 4, acc, sizeof(acc));
+    }
+}
+
+void resize_row_v(float *tmp, uint8_t *out, uint32_t width, uint32_t start,
+                  float *weights, uint32_t taps) {
+    uint32_t stride = width * 4;
+    for (uint32_t i = 0; i < width * 4; i++) {
+        float acc = 0.f;
+        for (uint32_t k = 0; k < taps; k++)
+            acc += tmp[(size_t)(start + k) * stride + i] * weights[k];
+        out[i] = acc <= 0.f ? 0 : acc >= 255.f ? 255 : (uint8_t)(acc + 0.5f);
+    }
+}
+
+void resize_h_job(void *arg, uint32_t first, uint32_t last) {
+    Resize *r = arg;
+    for (uint32_t y = first; y < last; y++) {
+        uint8_t *src = r->src + (size_t)y * r->src_width * 4;
+        float *out = r->tmp + (size_t)y * r->dst_width * 4;
+#if defined(__x86_64__) || defined(__i386__)
+        if (kernels.isa >= ISA_AVX2) {
+            resize_row_h_avx2(src, out, r->horizontal);
+            continue;
+        }
+#endif
+        resize_row_h(src, out, r->horizontal);
+    }
+}
+
+void resize_v_job(void *arg, uint32_t first, uint32_t last) {
+    Resize *r = arg;
+    Weights *w = r->vertical;
+    for (uint32_t y = first; y < last; y++) {
+        uint8_t *out = r->dst + (size_t)y * r->dst_width * 4;
+        float *weights = w->weights + y * w->taps;
+#if defined(__x86_64__) || defined(__i386__)
+        if (kernels.isa >= ISA_AVX2) {
+            resize_row_v_avx2(r->tmp, out, r->dst_width, w->start[y], weights,
+                              w->taps);
+            continue;
+        }
+#endif
+        resize_row_v(r->tmp, out, r->dst_width, w->start[y], weights,
+                     w->taps);
+    }
+}
+
+// resizes an rgba image, strips of rows are done on all cores
+Image resize_image(Image image, uint32_t width, uint32_t height,
+                   ResizeFilter filter) {
+    if (width == 0 || height == 0)
+        panic("Can't resize to an empty image");
+
+    Resize r = {
+        .src = image.data,
+        .src_width = image.width,
+        .tmp = malloc((size_t)image.height * width * 4 * sizeof(float)),
+        .dst = malloc((size_t)width * height * 4),
+        .dst_width = width,
+        .horizontal = get_weights(image.width, width, filter),
+        .vertical = get_weights(image.height, height, filter),
+    };
+
+    parallel_for(image.height, 32, resize_h_job, &r);
+    parallel_for(height, 32, resize_v_job, &r);
+
+    weights_put(r.horizontal);
+    weights_put(r.vertical);
+    free(r.tmp);
+
+    return (Image){
+        .data = r.dst,
+        .width = width,
+        .height = height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+}
+
+/*
+ * Verify
+ *
+ * Checks that a png would decode without keeping any pixels: chunk layout and
+ * CRCs, IHDR values, the whole zlib stream including its Adler-32, filter
+ * bytes and the number of rows. IDAT chunks are inflated as they are read into
+ * a single row so memory only depends on the width.
+ */
+
+#define VERIFY_BUFF 65536
+
+typedef struct {
+    uint32_t width;
+    uint32_t height;
+    uint32_t bit_depth;
+    uint32_t color_type;
+    uint32_t interlace;
+
+    z_stream strm;
+    bool stream_end;
+    uint8_t *row; // filter byte + one row
+    size_t row_len;
+    size_t have;
+    int32_t pass; // adam7 pass, 0 when not interlaced
+    uint32_t pass_height;
+    uint32_t y; // row in the current pass
+    uint64_t rows; // rows checked
+} Verify;
+
+// size of the rows of an adam7 pass (pass 0 is the whole image), 0 if empty
+void pass_size(Verify *v, uint32_t pass, uint32_t *width, uint32_t *height) {
+    static const uint8_t x0[] = {0, 0, 4, 0, 2, 0, 1, 0};
+    static const uint8_t y0[] = {0, 0, 0, 4, 0, 2, 0, 1};
+    static const uint8_t dx[] = {1, 8, 8, 4, 4, 2, 2, 1};
+    static const uint8_t dy[] = {1, 8, 8, 8, 4, 4, 2, 2};
+
+    *width = v->width > x0[pass] ? (v->width - x0[pass] + dx[pass] - 1) / dx[pass]
+                                 : 0;
+    *height = v->height > y0[pass]
+                  ? (v->height - y0[pass] + dy[pass] - 1) / dy[pass]
+                  : 0;
+    if (*width == 0)
+        *height = 0;
+}
+
+// moves on to the next adam7 pass that has rows (the whole image when not
+// interlaced), false once there are none left
+bool next_pass(Verify *v) {
+    uint32_t width, height = 0;
+    while (height == 0) {
+        v->pass++;
+        if (v->pass > (v->interlace ? 7 : 0))
+            return false;
+        if (v->interlace && v->pass == 0)
+            v->pass = 1;
+        pass_size(v, v->pass, &width, &height);
+    }
+
+    v->pass_height = height;
+    v->row_len = ((uint64_t)width * channels(v->color_type) * v->bit_depth +
+                  7) / 8 + 1;
+    v->y = 0;
+    return true;
+}
+
+bool verify_idat(Verify *v, uint8_t *data, uint32_t length, long offset,
+                 char *err, size_t errlen) {
+    v->strm.next_in = data;
+    v->strm.avail_in = length;
+
+    while (v->strm.avail_in > 0) {
+        if (v->stream_end) {
+            snprintf(err, errlen, "IDAT at offset %ld: data after zlib stream",
+                     offset);
+            return false;
+        }
+
+        // inflate into the row, or a scratch byte once every row was seen so
+        // extra data is noticed
+        uint8_t extra;
+        bool done = v->row_len == 0;
+        v->strm.next_out = done ? &extra : v->row + v->have;
+        v->strm.avail_out = done ? 1 : v->row_len - v->have;
+
+        int ret = inflate(&v->strm, Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            v->stream_end = true;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            snprintf(err, errlen, "IDAT at offset %ld: zlib: %s", offset,
+                     v->strm.msg ? v->strm.msg : "error");
+            return false;
+        }
+
+        if (done) {
+            if (v->strm.avail_out == 0) {
+                snprintf(err, errlen,
+                         "IDAT at offset %ld: more data than %u rows", offset,
+                         v->height);
+                return false;
+            }
+            continue;
+        }
+
+        v->have = v->row_len - v->strm.avail_out;
+        if (v->have < v->row_len)
+            continue;
+
+        if (v->row[0] > 4) {
+            snprintf(err, errlen,
+                     "IDAT at offset %ld: row %u (pass %d) has filter %u",
+                     offset, v->y, v->pass, v->row[0]);
+            return false;
+        }
+
+        v->have = 0;
+        v->rows++;
+        if (++v->y == v->pass_height && !next_pass(v))
+            v->row_len = 0; // every row is there
+    }
+
+    return true;
+}
+
+bool verify_png(const char *pngfile, char *err, size_t errlen) {
+    FILE *file = fopen(pngfile, "rb");
+    if (file == NULL) {
+        snprintf(err, errlen, "%s", strerror(errno));
+        return false;
+    }
+
+    Verify v = {0};
+    uint8_t *buff = malloc(VERIFY_BUFF);
+    bool ok = false;
+    bool seen_ihdr = false, seen_idat = false, idat_done = false;
+    bool seen_iend = false;
+
+    uint8_t sig[8];
+    static const uint8_t png_sig[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A,
+                                       0x1A, 0x0A};
+    if (fread(sig, CHAR, 8, file) != 8 || memcmp(sig, png_sig, 8) != 0) {
+        snprintf(err, errlen, "offset 0: invalid PNG signature");
+        goto out;
+    }
+
+    while (!seen_iend) {
+        long offset = ftell(file);
+        uint8_t head[8];
+        if (fread(head, CHAR, 8, file) != 8) {
+            snprintf(err, errlen, "offset %ld: missing IEND", offset);
+            goto out;
+        }
+
+        uint32_t length = convert_uint(head);
+        char type[5];
+        memcpy(type, head + 4, 4);
+        type[4] = '\0';
+
+        if (length > 0x7fffffff) {
+            snprintf(err, errlen, "%s at offset %ld: bad length %u", type,
+                     offset, length);
+            goto out;
+        }
+        for (int i = 0; i < 4; i++) {
+            if (!((type[i] >= 'a' && type[i] <= 'z') ||
+                  (type[i] >= 'A' && type[i] <= 'Z'))) {
+                snprintf(err, errlen, "offset %ld: bad chunk type", offset);
+                goto out;
+            }
+        }
+
+        bool is_idat = strcmp(type, "IDAT") == 0;
+        if (!seen_ihdr && strcmp(type, "IHDR") != 0) {
+            snprintf(err, errlen, "%s at offset %ld: expected IHDR first",
+                     type, offset);
+            goto out;
+        }
+        if (seen_idat && !is_idat)
+            idat_done = true;
+        if (is_idat && idat_done) {
+            snprintf(err, errlen, "IDAT at offset %ld: IDATs not consecutive",
+                     offset);
+            goto out;
+        }
+        if (!(type[0] & 0x20) && !is_idat && strcmp(type, "IHDR") != 0 &&
+            strcmp(type, "IEND") != 0 && strcmp(type, "PLTE") != 0) {
+            snprintf(err, errlen, "%s at offset %ld: unknown critical chunk",
+                     type, offset);
+            goto out;
+        }
+
+        uLong crc = crc32(0, head + 4, 4);
+        uint32_t left = length;
+        while (left > 0) {
+            uint32_t n = left < VERIFY_BUFF ? left : VERIFY_BUFF;
+            if (fread(buff, CHAR, n, file) != n) {
+                snprintf(err, errlen, "%s at offset %ld: truncated", type,
+                         offset);
+                goto out;
+            }
+            crc = crc32(crc, buff, n);
+
+            if (strcmp(type, "IHDR") == 0) {
+                if (length != 13 || seen_ihdr) {
+                    snprintf(err, errlen, "IHDR at offset %ld: bad IHDR",
+                             offset);
+                    goto out;
+                }
+                v.width = convert_uint(buff);
+                v.height = convert_uint(buff + 4);
+                v.bit_depth = buff[8];
+                v.color_type = buff[9];
+                v.interlace = buff[12];
+                if (v.width == 0 || v.height == 0 || v.width > 0x7fffffff ||
+                    v.height > 0x7fffffff ||
+                    !valid_depth(v.color_type, v.bit_depth) || buff[10] != 0 ||
+                    buff[11] != 0 || v.interlace > 1) {
+                    snprintf(err, errlen, "IHDR at offset %ld: invalid header",
+                             offset);
+                    goto out;
+                }
+            } else if (is_idat) {
+                if (!seen_idat) {
+                    if (inflateInit(&v.strm) != Z_OK) {
+                        snprintf(err, errlen, "inflateInit failed");
+                        goto out;
+                    }
+                    // biggest row is the one of the whole image
+                    v.row = malloc(((uint64_t)v.width *
+                                        channels(v.color_type) * v.bit_depth +
+                                    7) / 8 + 1);
+                    v.pass = -1;
+                    next_pass(&v);
+                    seen_idat = true;
+                }
+                if (!verify_idat(&v, buff, n, offset, err, errlen))
+                    goto out;
+            }
+            left -= n;
+        }
+
+        if (strcmp(type, "IHDR") == 0)
+            seen_ihdr = true;
+        if (strcmp(type, "IEND") == 0)
+            seen_iend = true;
+
+        uint8_t stored[4];
+        if (fread(stored, CHAR, CRC, file) != CRC) {
+            snprintf(err, errlen, "%s at offset %ld: missing CRC", type,
+                     offset);
+            goto out;
+        }
+        if (convert_uint(stored) != (uint32_t)crc) {
+            snprintf(err, errlen,
+                     "%s at offset %ld: CRC mismatch (stored %08x, actual "
+                     "%08x)",
+                     type, offset, convert_uint(stored), (uint32_t)crc);
+            goto out;
+        }
+    }
+
+    if (!seen_idat) {
+        snprintf(err, errlen, "no IDAT chunks");
+    } else if (v.row_len != 0) {
+        snprintf(err, errlen, "image data ends at row %u (pass %d)", v.y,
+                 v.pass);
+    } else if (!v.stream_end) {
+        snprintf(err, errlen, "zlib stream is not finished (no Adler-32)");
+    } else if (fgetc(file) != EOF) {
+        snprintf(err, errlen, "offset %ld: data after IEND", ftell(file) - 1);
+    } else {
+        ok = true;
+    }
+
+out:
+    if (seen_idat)
+        inflateEnd(&v.strm);
+    free(v.row);
+    free(buff);
+    fclose(file);
+    return ok;
+}
+
+typedef struct {
+    char **files;
+    bool *ok;
+    char (*errors)[256];
+} VerifyBatch;
+
+void verify_job(void *arg, uint32_t first, uint32_t last) {
+    VerifyBatch *batch = arg;
+    for (uint32_t i = first; i < last; i++)
+        batch->ok[i] = verify_png(batch->files[i], batch->errors[i],
+                                  sizeof(batch->errors[i]));
+}
+
+// verifies all files on all cores, returns how many failed
+uint32_t verify_files(char **files, uint32_t count) {
+    VerifyBatch batch = {
+        .files = files,
+        .ok = calloc(count, sizeof(bool)),
+        .errors = calloc(count, sizeof(*batch.errors)),
+    };
+
+    parallel_for(count, 1, verify_job, &batch);
+
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (batch.ok[i]) {
+            printf("%s: OK\n", files[i]);
+        } else {
+            printf("%s: %s\n", files[i], batch.errors[i]);
+            failed++;
+        }
+    }
+
+    free(batch.ok);
+    free(batch.errors);
+    return failed;
+}
+
+/*
+ * Encoder
+ *
+ * Rows are filtered and then compressed in strips on all cores, pigz style:
+ * every strip is its own raw deflate stream primed with the 32K of data in
+ * front of it as dictionary and ends with a full flush, so the strips can just
+ * be concatenated. The Adler-32s of the strips are put together with
+ * adler32_combine() and each strip becomes one IDAT.
+ */
+
+#define STRIP_BYTES (256 * 1024) // least filtered bytes per strip
+
+typedef enum {
+    SELECT_MINSUM,  // least sum of absolute values of the filtered row
+    SELECT_ENTROPY, // least estimated huffman coded size
+    SELECT_BRUTE,   // deflate every filtered version of the row, keep smallest
+    SELECT_FIXED,   // EncodeOptions.filter for every row
+} FilterSelect;
+
+typedef struct {
+    int level;           // zlib level, 0 means Z_DEFAULT_COMPRESSION
+    FilterSelect select; // how each row picks its filter
+    uint8_t filter;      // filter for SELECT_FIXED
+    int strategy;        // zlib strategy, Z_DEFAULT_STRATEGY is 0
+    bool fast_deflate;   // fast_deflate() instead of zlib, ignores level
+    uint32_t strip_rows; // rows per strip, 0 picks by size
+} EncodeOptions;
+
+typedef struct {
+    uint8_t *pixels;
+    uint32_t height;
+    size_t stride;
+    uint32_t bpp;
+    EncodeOptions *opts;
+
+    uint8_t *filtered; // height * (stride + 1)
+    uint32_t strip_rows;
+
+    uint8_t **out; // compressed strips
+    size_t *out_len;
+    uLong *adler;
+} Encode;
+
+void filter_row(uint8_t filter, uint8_t *row, uint8_t *prev_row, uint8_t *out,
+                size_t stride, uint32_t bpp) {
+    // none and sub don't need the row above, and with the switch out of the
+    // loop they vectorize
+    if (filter == 0 || filter == 1) {
+        size_t first = filter == 0 || stride < bpp ? stride : bpp;
+        memcpy(out, row, first);
+        for (size_t x = first; x < stride; x++)
+            out[x] = row[x] - row[x - bpp];
+        return;
+    }
+
+    for (size_t x = 0; x < stride; x++) {
+        uint8_t left = (x >= bpp) ? row[x - bpp] : 0;
+        uint8_t above = prev_row ? prev_row[x] : 0;
+        uint8_t upper_left = (x >= bpp && prev_row) ? prev_row[x - bpp] : 0;
+
+        switch (filter) {
+        case 1:
+            out[x] = row[x] - left;
+            break;
+        case 2:
+            out[x] = row[x] - above;
+            break;
+        case 3:
+            out[x] = row[x] - ((left + above) >> 1);
+            break;
+        case 4:
+            out[x] = row[x] - paeth_predictor(left, above, upper_left);
+            break;
+        default:
+            out[x] = row[x];
+            break;
+        }
+    }
+}
+
+// |filtered byte| taken as signed, summed up per row it's the usual png
+// heuristic for picking a filter
+static inline uint8_t signed_abs(uint8_t v) { return v < 128 ? v : 256 - v; }
+
+// filters row with all five filters in one pass, filter f goes to
+// out + f * stride and the sum of its signed_abs() to sums[f]. prev_row is all
+// zeros for the first row
+void filter_row_all(uint8_t *row, uint8_t *prev_row, uint8_t *out,
+                    size_t stride, uint32_t bpp, uint64_t sums[5]) {
+    uint8_t *o[5];
+    for (int f = 0; f < 5; f++) {
+        o[f] = out + f * stride;
+        sums[f] = 0;
+    }
+
+    size_t x = 0;
+    for (; x < bpp && x < stride; x++) {
+        // nothing on the left, paeth picks above
+        uint8_t b = prev_row[x];
+        uint8_t f[5] = {row[x], row[x], row[x] - b, row[x] - (b >> 1),
+                        row[x] - b};
+        for (int k = 0; k < 5; k++) {
+            o[k][x] = f[k];
+            sums[k] += signed_abs(f[k]);
+        }
+    }
+
+#ifdef __SSE2__
+    if (kernels.isa >= ISA_SSE2) {
+        __m128i zero = _mm_setzero_si128();
+        __m128i one8 = _mm_set1_epi8(1);
+        __m128i one16 = _mm_set1_epi16(1);
+        __m128i sum[5] = {zero, zero, zero, zero, zero};
+
+        for (; x + 16 <= stride; x += 16) {
+            __m128i cur = _mm_loadu_si128((__m128i *)(row + x));
+            __m128i a = _mm_loadu_si128((__m128i *)(row + x - bpp));
+            __m128i b = _mm_loadu_si128((__m128i *)(prev_row + x));
+            __m128i c = _mm_loadu_si128((__m128i *)(prev_row + x - bpp));
+
+            // _mm_avg_epu8 rounds up, the average filter wants floor
+            __m128i avg = _mm_sub_epi8(
+                _mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one8));
+
+            // paeth in 16 bits: pa = |b - c|, pb = |a - c|, pc = |a + b - 2c|
+            __m128i pred[2];
+            for (int h = 0; h < 2; h++) {
+                __m128i a16 = h ? _mm_unpackhi_epi8(a, zero)
+                                : _mm_unpacklo_epi8(a, zero);
+                __m128i b16 = h ? _mm_unpackhi_epi8(b, zero)
+                                : _mm_unpacklo_epi8(b, zero);
+                __m128i c16 = h ? _mm_unpackhi_epi8(c, zero)
+                                : _mm_unpacklo_epi8(c, zero);
+
+                __m128i pa = _mm_sub_epi16(b16, c16);
+                __m128i pb = _mm_sub_epi16(a16, c16);
+                __m128i pc = _mm_add_epi16(pa, pb);
+                pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+                pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+                pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+
+                // x <= y is y + 1 > x
+                __m128i pb1 = _mm_add_epi16(pb, one16);
+                __m128i pc1 = _mm_add_epi16(pc, one16);
+                __m128i use_a = _mm_and_si128(_mm_cmpgt_epi16(pb1, pa),
+                                              _mm_cmpgt_epi16(pc1, pa));
+                __m128i use_b = _mm_cmpgt_epi16(pc1, pb);
+
+                __m128i p = _mm_or_si128(_mm_and_si128(use_b, b16),
+                                         _mm_andnot_si128(use_b, c16));
+                pred[h] = _mm_or_si128(_mm_and_si128(use_a, a16),
+                                       _mm_andnot_si128(use_a, p));
+            }
+            __m128i paeth = _mm_packus_epi16(pred[0], pred[1]);
+
+            __m128i f[5] = {cur, _mm_sub_epi8(cur, a), _mm_sub_epi8(cur, b),
+                            _mm_sub_epi8(cur, avg), _mm_sub_epi8(cur, paeth)};
+            for (int k = 0; k < 5; k++) {
+                _mm_storeu_si128((__m128i *)(o[k] + x), f[k]);
+                // signed_abs() is min(v, -v) unsigned
+                __m128i abs8 = _mm_min_epu8(f[k], _mm_sub_epi8(zero, f[k]));
+                sum[k] = _mm_add_epi64(sum[k], _mm_sad_epu8(abs8, zero));
+            }
+        }
+
+        for (int k = 0; k < 5; k++)
+            sums[k] += _mm_cvtsi128_si64(sum[k]) +
+                       _mm_cvtsi128_si64(_mm_unpackhi_epi64(sum[k], sum[k]));
+    }
+#endif
+
+    for (; x < stride; x++) {
+        uint8_t a = row[x - bpp], b = prev_row[x], c = prev_row[x - bpp];
+        uint8_t f[5] = {row[x], row[x] - a, row[x] - b,
+                        row[x] - ((a + b) >> 1),
+                        row[x] - paeth_predictor(a, b, c)};
+        for (int k = 0; k < 5; k++) {
+            o[k][x] = f[k];
+            sums[k] += signed_abs(f[k]);
+        }
+    }
+}
+
+// estimated bits to code the row with a huffman code of its own histogram
+float entropy(uint8_t *data, size_t n) {
+    uint32_t hist[256] = {0};
+    for (size_t i = 0; i < n; i++)
+        hist[data[i]]++;
+
+    float bits = 0.f;
+    float log_n = log2f(n);
+    for (int i = 0; i < 256; i++)
+        if (hist[i])
+            bits += hist[i] * (log_n - log2f(hist[i]));
+    return bits;
+}
+
+// deflated size of the row on its own
+size_t deflated_size(z_stream *strm, uint8_t *data, size_t n, uint8_t *out,
+                     size_t cap) {
+    deflateReset(strm);
+    strm->next_in = data;
+    strm->avail_in = n;
+    strm->next_out = out;
+    strm->avail_out = cap;
+    deflate(strm, Z_FINISH);
+    return cap - strm->avail_out;
+}
+
+void filter_job(void *arg, uint32_t first, uint32_t last) {
+    Encode *e = arg;
+    FilterSelect select = e->opts->select;
+
+    uint8_t *zeros = NULL; // row above the first one
+    uint8_t *candidates = NULL;
+    uint8_t *scratch = NULL;
+    size_t cap = 0;
+    z_stream strm = {0};
+
+    if (select != SELECT_FIXED) {
+        zeros = calloc(e->stride, 1);
+        candidates = malloc(5 * e->stride);
+    }
+    if (select == SELECT_BRUTE) {
+        int level = e->opts->level ? e->opts->level : Z_DEFAULT_COMPRESSION;
+        if (deflateInit(&strm, level) != Z_OK)
+            panic("error with deflate init");
+        cap = deflateBound(&strm, e->stride);
+        scratch = malloc(cap);
+    }
+
+    for (uint32_t y = first; y < last; y++) {
+        uint8_t *row = e->pixels + y * e->stride;
+        uint8_t *prev_row = y > 0 ? row - e->stride : NULL;
+        uint8_t *out = e->filtered + y * (e->stride + 1);
+
+        if (select == SELECT_FIXED) {
+            out[0] = e->opts->filter;
+            filter_row(out[0], row, prev_row, out + 1, e->stride, e->bpp);
+            continue;
+        }
+
+        uint64_t sums[5];
+        filter_row_all(row, prev_row ? prev_row : zeros, candidates, e->stride,
+                       e->bpp, sums);
+
+        uint8_t best = 0;
+        float best_cost = 0.f;
+        for (uint8_t f = 0; f < 5; f++) {
+            uint8_t *c = candidates + f * e->stride;
+            float cost = select == SELECT_ENTROPY ? entropy(c, e->stride)
+                         : select == SELECT_BRUTE
+                             ? deflated_size(&strm, c, e->stride, scratch, cap)
+                             : sums[f];
+            if (f == 0 || cost < best_cost) {
+                best = f;
+                best_cost = cost;
+            }
+        }
+
+        out[0] = best;
+        memcpy(out + 1, candidates + best * e->stride, e->stride);
+    }
+
+    if (select == SELECT_BRUTE)
+        deflateEnd(&strm);
+    free(zeros);
+    free(candidates);
+    free(scratch);
+}
+
+/*
+ * Fast deflate
+ *
+ * Even zlib at level 1 with Z_RLE is too slow to write screenshots within a
+ * frame. This writes one dynamic huffman block per strip whose only matches
+ * are runs (distance 1, the same thing Z_RLE finds) so there is no match
+ * search at all: one pass counts the symbols, a second one writes them using
+ * a code built from those counts and the precomputed length code table.
+ */
+
+typedef struct {
+    uint16_t symbol; // 257..285
+    uint8_t bits;    // extra bits
+    uint8_t extra;   // value of the extra bits
+} LengthCode;
+
+LengthCode length_codes[259]; // run lengths 3..258
+pthread_once_t length_codes_once = PTHREAD_ONCE_INIT;
+
+void init_length_codes(void) {
+    static const uint16_t base[29] = {3,  4,  5,  6,   7,   8,   9,   10,
+                                      11, 13, 15, 17,  19,  23,  27,  31,
+                                      35, 43, 51, 59,  67,  83,  99,  115,
+                                      131, 163, 195, 227, 258};
+    static const uint8_t bits[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                     1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                     4, 4, 4, 4, 5, 5, 5, 5, 0};
+
+    for (int i = 0; i < 28; i++)
+        for (int len = base[i]; len < base[i + 1]; len++)
+            length_codes[len] = (LengthCode){257 + i, bits[i], len - base[i]};
+    length_codes[258] = (LengthCode){285, 0, 0};
+}
+
+typedef struct {
+    uint8_t *out;
+    size_t pos;
+    uint64_t buff;
+    int count; // bits in buff
+} BitWriter;
+
+static inline void put_bits(BitWriter *w, uint32_t bits, int n) {
+    w->buff |= (uint64_t)bits << w->count;
+    w->count += n;
+    if (w->count >= 32) {
+        uint32_t word = (uint32_t)w->buff; // deflate is lsb first
+        memcpy(w->out + w->pos, &word, 4);
+        w->pos += 4;
+        w->buff >>= 32;
+        w->count -= 32;
+    }
+}
+
+void flush_bits(BitWriter *w) {
+    while (w->count > 0) {
+        w->out[w->pos++] = w->buff & 0xff;
+        w->buff >>= 8;
+        w->count -= 8;
+    }
+    w->buff = 0;
+    w->count = 0;
+}
+
+// Moffat and Katajainen's in place minimum redundancy code. A has n weights
+// sorted increasingly and gets the code lengths
+void minimum_redundancy(uint32_t *A, int n) {
+    if (n == 1) {
+        A[0] = 1;
+        return;
+    }
+
+    int root = 0, leaf = 2, next;
+    A[0] += A[1];
+    for (next = 1; next < n - 1; next++) {
+        if (leaf >= n || A[root] < A[leaf]) {
+            A[next] = A[root];
+            A[root++] = next;
+        } else {
+            A[next] = A[leaf++];
+        }
+        if (leaf >= n || (root < next && A[root] < A[leaf])) {
+            A[next] += A[root];
+            A[root++] = next;
+        } else {
+            A[next] += A[leaf++];
+        }
+    }
+
+    A[n - 2] = 0;
+    for (next = n - 3; next >= 0; next--)
+        A[next] = A[A[next]] + 1;
+
+    int avbl = 1, used = 0, depth = 0;
+    root = n - 2;
+    next = n - 1;
+    while (avbl > 0) {
+        while (root >= 0 && (int)A[root] == depth) {
+            used++;
+            root--;
+        }
+        while (avbl > used) {
+            A[next--] = depth;
+            avbl--;
+        }
+        avbl = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+// huffman code lengths of at most max_bits for n symbols with freq, unused
+// symbols get 0
+void huffman_lengths(uint32_t *freq, int n, int max_bits, uint8_t *lengths) {
+    uint32_t order[288];
+    uint32_t weight[288];
+    int used = 0;
+
+    memset(lengths, 0, n);
+    for (int i = 0; i < n; i++)
+        if (freq[i])
+            order[used++] = i;
+    if (used == 0)
+        return;
+
+    // insertion sort by frequency, there are at most 288 symbols
+    for (int i = 1; i < used; i++) {
+        uint32_t sym = order[i];
+        int j = i;
+        for (; j > 0 && freq[order[j - 1]] > freq[sym]; j--)
+            order[j] = order[j - 1];
+        order[j] = sym;
+    }
+    for (int i = 0; i < used; i++)
+        weight[i] = freq[order[i]];
+
+    minimum_redundancy(weight, used);
+
+    // too long codes are cut down like miniz does it, then the shortest
+    // lengths are handed to the most frequent symbols again
+    int count[33] = {0};
+    for (int i = 0; i < used; i++)
+        count[weight[i] < 32 ? weight[i] : 32]++;
+
+    for (int i = max_bits + 1; i <= 32; i++) {
+        count[max_bits] += count[i];
+        count[i] = 0;
+    }
+    uint32_t total = 0;
+    for (int i = max_bits; i > 0; i--)
+        total += (uint32_t)count[i] << (max_bits - i);
+    while (used > 1 && total != (1u << max_bits)) {
+        count[max_bits]--;
+        for (int i = max_bits - 1; i > 0; i--) {
+            if (count[i]) {
+                count[i]--;
+                count[i + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    int j = used;
+    for (int len = 1; len <= max_bits; len++)
+        for (int k = count[len]; k > 0; k--)
+            lengths[order[--j]] = len;
+}
+
+// canonical codes for lengths, bit reversed since deflate writes them msb first
+void huffman_codes(uint8_t *lengths, int n, uint16_t *codes) {
+    uint16_t count[16] = {0};
+    uint16_t next[16] = {0};
+    for (int i = 0; i < n; i++)
+        count[lengths[i]]++;
+    count[0] = 0;
+
+    for (int len = 1; len < 16; len++)
+        next[len] = (next[len - 1] + count[len - 1]) << 1;
+
+    for (int i = 0; i < n; i++) {
+        int len = lengths[i];
+        if (len == 0)
+            continue;
+        uint16_t code = next[len]++;
+        uint16_t reversed = 0;
+        for (int b = 0; b < len; b++)
+            reversed |= ((code >> b) & 1) << (len - 1 - b);
+        codes[i] = reversed;
+    }
+}
+
+// length of the run of data[-1] at data, at most max
+static inline size_t run_length(uint8_t *data, size_t max) {
+    uint64_t pattern = 0x0101010101010101ULL * data[-1];
+    size_t run = 0;
+    while (run + 8 <= max) {
+        uint64_t v;
+        memcpy(&v, data + run, 8);
+        if (v != pattern)
+            return run + (__builtin_ctzll(v ^ pattern) >> 3);
+        run += 8;
+    }
+    while (run < max && data[run] == data[-1])
+        run++;
+    return run;
+}
+
+// worst case size of fast_deflate() output
+size_t fast_deflate_bound(size_t n) { return n * 15 / 8 + 1024; }
+
+// deflates data into out as one block, followed by an empty stored block unless
+// it's the last one (a full flush). returns the compressed size
+size_t fast_deflate(uint8_t *data, size_t n, bool last, uint8_t *out) {
+    pthread_once(&length_codes_once, init_length_codes);
+
+    uint32_t lit_freq[286] = {0};
+    uint32_t dist_freq[30] = {0};
+
+    for (int pass = 0; pass < 2; pass++) {
+        static const uint8_t order[19] = {16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+                                          11, 4,  12, 3, 13, 2, 14, 1, 15};
+        uint8_t lit_len[286], dist_len[30];
+        uint16_t lit_code[286], dist_code[30];
+        BitWriter w = {.out = out};
+
+        if (pass == 1) {
+            lit_freq[256] = 1; // end of block
+            dist_freq[0] = 1;  // a code is needed even without any runs
+            huffman_lengths(lit_freq, 286, 15, lit_len);
+            huffman_lengths(dist_freq, 30, 15, dist_len);
+            huffman_codes(lit_len, 286, lit_code);
+            huffman_codes(dist_len, 30, dist_code);
+
+            int hlit = 286;
+            while (hlit > 257 && lit_len[hlit - 1] == 0)
+                hlit--;
+            int hdist = 1;
+
+            // code lengths are sent as plain 0-15 symbols
+            uint32_t cl_freq[19] = {0};
+            uint8_t cl_len[19];
+            uint16_t cl_code[19];
+            for (int i = 0; i < hlit; i++)
+                cl_freq[lit_len[i]]++;
+            cl_freq[dist_len[0]]++;
+            huffman_lengths(cl_freq, 19, 7, cl_len);
+            huffman_codes(cl_len, 19, cl_code);
+
+            int hclen = 19;
+            while (hclen > 4 && cl_len[order[hclen - 1]] == 0)
+                hclen--;
+
+            put_bits(&w, last, 1);
+            put_bits(&w, 2, 2); // dynamic huffman
+            put_bits(&w, hlit - 257, 5);
+            put_bits(&w, hdist - 1, 5);
+            put_bits(&w, hclen - 4, 4);
+            for (int i = 0; i < hclen; i++)
+                put_bits(&w, cl_len[order[i]], 3);
+            for (int i = 0; i < hlit; i++)
+                put_bits(&w, cl_code[lit_len[i]], cl_len[lit_len[i]]);
+            put_bits(&w, cl_code[dist_len[0]], cl_len[dist_len[0]]);
+        }
+
+        size_t i = 0;
+        while (i < n) {
+            size_t run = 0;
+            if (i > 0) {
+                size_t max = n - i < 258 ? n - i : 258;
+                run = run_length(data + i, max);
+            }
+
+            if (run >= 3) {
+                LengthCode lc = length_codes[run];
+                if (pass == 0) {
+                    lit_freq[lc.symbol]++;
+                    dist_freq[0]++;
+                } else {
+                    put_bits(&w, lit_code[lc.symbol], lit_len[lc.symbol]);
+                    put_bits(&w, lc.extra, lc.bits);
+                    put_bits(&w, dist_code[0], dist_len[0]);
+                }
+                i += run;
+            } else {
+                if (pass == 0)
+                    lit_freq[data[i]]++;
+                else
+                    put_bits(&w, lit_code[data[i]], lit_len[data[i]]);
+                i++;
+            }
+        }
+
+        if (pass == 1) {
+            put_bits(&w, lit_code[256], lit_len[256]);
+            if (!last) {
+                // empty stored block to get back to a byte boundary
+                put_bits(&w, 0, 3);
+                flush_bits(&w);
+                put_bits(&w, 0xffff0000, 32);
+            }
+            flush_bits(&w);
+            return w.pos;
+        }
+    }
+
+    return 0;
+}
+
+void deflate_job(void *arg, uint32_t first, uint32_t last) {
+    Encode *e = arg;
+    size_t row_len = e->stride + 1;
+    uint32_t strips = (e->height + e->strip_rows - 1) / e->strip_rows;
+
+    for (uint32_t s = first; s < last; s++) {
+        size_t start = (size_t)s * e->strip_rows * row_len;
+        size_t end = (size_t)(s + 1) * e->strip_rows * row_len;
+        if (end > e->height * row_len)
+            end = e->height * row_len;
+
+        e->adler[s] = adler32(1, e->filtered + start, end - start);
+
+        if (e->opts->fast_deflate) {
+            e->out[s] = malloc(fast_deflate_bound(end - start));
+            e->out_len[s] = fast_deflate(e->filtered + start, end - start,
+                                         s == strips - 1, e->out[s]);
+            continue;
+        }
+
+        z_stream strm = {0};
+        int level = e->opts->level ? e->opts->level : Z_DEFAULT_COMPRESSION;
+        if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8,
+                         e->opts->strategy) != Z_OK)
+            panic("error with deflate init");
+
+        if (start > 0) {
+            size_t dict = start < WINSIZE ? start : WINSIZE;
+            deflateSetDictionary(&strm, e->filtered + start - dict, dict);
+        }
+
+        size_t cap = deflateBound(&strm, end - start) + 16;
+        e->out[s] = malloc(cap);
+        strm.next_in = e->filtered + start;
+        strm.avail_in = end - start;
+        strm.next_out = e->out[s];
+        strm.avail_out = cap;
+
+        int ret = deflate(&strm, s == strips - 1 ? Z_FINISH : Z_FULL_FLUSH);
+        if (ret != Z_STREAM_END && ret != Z_OK)
+            panic("error with deflate");
+
+        e->out_len[s] = cap - strm.avail_out;
+        deflateEnd(&strm);
+    }
+}
+
+void write_chunk(FILE *file, const char *type, uint8_t *data,
+                 uint32_t length) {
+    uint8_t head[8];
+    uint32_t n = __builtin_bswap32(length);
+    memcpy(head, &n, 4);
+    memcpy(head + 4, type, 4);
+
+    uLong crc = crc32(0, head + 4, 4);
+    if (length) // crc32() with a NULL buffer resets the crc
+        crc = crc32(crc, data, length);
+    n = __builtin_bswap32(crc);
+
+    fwrite(head, CHAR, 8, file);
+    fwrite(data, CHAR, length, file);
+    fwrite(&n, CHAR, CRC, file);
+}
+
+typedef struct {
+    uint8_t *pixels; // rows packed the way they go into the png
+    uint32_t width;
+    uint32_t height;
+    uint32_t bit_depth;
+    uint32_t color_type;
+
+    uint8_t *palette; // rgba entries for COLOR_INDEXED, alpha goes to tRNS
+    uint32_t palette_size;
+
+    uint8_t *chunks; // complete chunks written after IHDR as they are
+    size_t chunks_len;
+} PngImage;
+
+void encode_png(FILE *file, PngImage *img, EncodeOptions *opts) {
+    EncodeOptions defaults = {0};
+    if (opts == NULL)
+        opts = &defaults;
+
+    uint32_t height = img->height;
+    uint32_t bits = channels(img->color_type) * img->bit_depth;
+    Encode e = {
+        .pixels = img->pixels,
+        .height = height,
+        .stride = ((size_t)img->width * bits + 7) / 8,
+        .bpp = bits < 8 ? 1 : bits / 8,
+        .opts = opts,
+    };
+    e.filtered = malloc(height * (e.stride + 1));
+
+    e.strip_rows = opts->strip_rows;
+    if (e.strip_rows == 0)
+        e.strip_rows = STRIP_BYTES / (e.stride + 1) + 1;
+    uint32_t strips = (height + e.strip_rows - 1) / e.strip_rows;
+
+    e.out = calloc(strips, sizeof(uint8_t *));
+    e.out_len = calloc(strips, sizeof(size_t));
+    e.adler = calloc(strips, sizeof(uLong));
+
+    parallel_for(height, 64, filter_job, &e);
+    parallel_for(strips, 1, deflate_job, &e);
+
+    static const uint8_t sig[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+    fwrite(sig, CHAR, 8, file);
+
+    uint8_t ihdr[13] = {0};
+    uint32_t n = __builtin_bswap32(img->width);
+    memcpy(ihdr, &n, 4);
+    n = __builtin_bswap32(height);
+    memcpy(ihdr + 4, &n, 4);
+    ihdr[8] = img->bit_depth;
+    ihdr[9] = img->color_type;
+    write_chunk(file, "IHDR", ihdr, sizeof(ihdr));
+
+    if (img->chunks_len)
+        fwrite(img->chunks, CHAR, img->chunks_len, file);
+
+    if (img->color_type == COLOR_INDEXED) {
+        uint8_t plte[256 * 3];
+        uint8_t trns[256];
+        uint32_t trns_len = 0;
+        for (uint32_t i = 0; i < img->palette_size; i++) {
+            memcpy(plte + i * 3, img->palette + i * 4, 3);
+            trns[i] = img->palette[i * 4 + 3];
+            if (trns[i] != 255)
+                trns_len = i + 1;
+        }
+        write_chunk(file, "PLTE", plte, img->palette_size * 3);
+        if (trns_len)
+            write_chunk(file, "tRNS", trns, trns_len);
+    }
+
+    // zlib header, the level only goes into FLEVEL
+    int level = opts->level ? opts->level : 6;
+    uint8_t flevel = level < 2 ? 0 : level < 6 ? 1 : level == 6 ? 2 : 3;
+    uint8_t zhead[2] = {0x78, flevel << 6};
+    zhead[1] += 31 - (zhead[0] * 256 + zhead[1]) % 31;
+
+    uLong adler = e.adler[0];
+    size_t row_len = e.stride + 1;
+    for (uint32_t s = 1; s < strips; s++) {
+        size_t rows = s == strips - 1 ? height - s * e.strip_rows : e.strip_rows;
+        adler = adler32_combine(adler, e.adler[s], rows * row_len);
+    }
+    uint8_t ztail[4];
+    n = __builtin_bswap32(adler);
+    memcpy(ztail, &n, 4);
+
+    for (uint32_t s = 0; s < strips; s++) {
+        // first and last strip carry the zlib header and trailer
+        size_t len = e.out_len[s] + (s == 0 ? 2 : 0) + (s == strips - 1 ? 4 : 0);
+        uint8_t *chunk = malloc(len);
+        uint8_t *p = chunk;
+        if (s == 0) {
+            memcpy(p, zhead, 2);
+            p += 2;
+        }
+        memcpy(p, e.out[s], e.out_len[s]);
+        p += e.out_len[s];
+        if (s == strips - 1)
+            memcpy(p, ztail, 4);
+
+        write_chunk(file, "IDAT", chunk, len);
+        free(chunk);
+    }
+
+    write_chunk(file, "IEND", NULL, 0);
+
+    for (uint32_t s = 0; s < strips; s++)
+        free(e.out[s]);
+    free(e.out);
+    free(e.out_len);
+    free(e.adler);
+    free(e.filtered);
+}
+
+// false if it can't be written
+bool write_png(const char *pngfile, PngImage *img, EncodeOptions *opts) {
+    FILE *file = fopen(pngfile, "wb");
+    if (file == NULL) {
+        perror("fopen");
+        return false;
+    }
+
+    encode_png(file, img, opts);
+
+    bool ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+// writes 8 bit rgb or rgba pixels to pngfile, false if it can't be written
+bool poder_encode(const char *pngfile, uint8_t *pixels, uint32_t width,
+                  uint32_t height, uint32_t color_type, EncodeOptions *opts) {
+    if (color_type != COLOR_TRUE_RGB && color_type != COLOR_TRUEALPHA_RGBA)
+        panic("Poder can only encode rgb and rgba");
+
+    PngImage img = {
+        .pixels = pixels,
+        .width = width,
+        .height = height,
+        .bit_depth = 8,
+        .color_type = color_type,
+    };
+    return write_png(pngfile, &img, opts);
+}
+
+/*
+ * QOI
+ *
+ * https://qoiformat.org, for hops between tools where deflate is overkill. it
+ * decodes many times faster than png and still compresses flat areas well.
+ * encoding is one pass over the pixels, runs are found 4 pixels at a time
+ * since they are most of what flat content is made of.
+ */
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF 0x40
+#define QOI_OP_LUMA 0x80
+#define QOI_OP_RUN 0xc0
+#define QOI_OP_RGB 0xfe
+#define QOI_OP_RGBA 0xff
+#define QOI_HEADER 14
+#define QOI_PIXELS_MAX 400000000 // same limit as the reference
+
+static const uint8_t qoi_padding[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+// pixels are rgba bytes read as one little endian word
+uint32_t load_pixel(uint8_t *p) {
+    uint32_t px;
+    memcpy(&px, p, 4);
+    return px;
+}
+
+uint32_t qoi_hash(uint32_t px) {
+    uint32_t r = px & 0xff, g = px >> 8 & 0xff, b = px >> 16 & 0xff,
+             a = px >> 24;
+    return (r * 3 + g * 5 + b * 7 + a * 11) % 64;
+}
+
+// how many pixels from first on are px
+uint32_t qoi_run(uint8_t *rgba, uint32_t first, uint32_t count, uint32_t px) {
+    uint32_t i = first;
+#ifdef __SSE2__
+    if (kernels.isa >= ISA_SSE2) {
+        const __m128i p = _mm_set1_epi32(px);
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128((__m128i *)(rgba + (size_t)i * 4));
+            int same = _mm_movemask_epi8(_mm_cmpeq_epi32(v, p));
+            if (same != 0xffff)
+                return i + __builtin_ctz(~same) / 4 - first;
+        }
+    }
+#endif
+    while (i < count && load_pixel(rgba + (size_t)i * 4) == px)
+        i++;
+    return i - first;
+}
+
+// 3 if every pixel is opaque, the decoder ignores it but it's in the header
+uint8_t qoi_channels(uint8_t *rgba, size_t count) {
+    size_t i = 0;
+#ifdef __SSE2__
+    if (kernels.isa >= ISA_SSE2) {
+        const __m128i alpha = _mm_set1_epi32(0xff000000);
+        for (; i + 4 <= count; i += 4) {
+            __m128i v = _mm_loadu_si128((__m128i *)(rgba + i * 4));
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(v, alpha),
+                                                  alpha)) != 0xffff)
+                return 4;
+        }
+    }
+#endif
+    for (; i < count; i++)
+        if (rgba[i * 4 + 3] != 255)
+            return 4;
+    return 3;
+}
+
+// rgba8 pixels to a malloced qoi file
+uint8_t *qoi_encode(uint8_t *rgba, uint32_t width, uint32_t height,
+                    size_t *len) {
+    uint32_t count = width * height;
+    uint8_t *out = malloc(QOI_HEADER + (size_t)count * 5 + 8);
+    uint8_t *o = out;
+
+    memcpy(o, "qoif", 4);
+    o[4] = width >> 24, o[5] = width >> 16, o[6] = width >> 8, o[7] = width;
+    o[8] = height >> 24, o[9] = height >> 16, o[10] = height >> 8,
+    o[11] = height;
+    o[12] = qoi_channels(rgba, count);
+    o[13] = 0; // sRGB
+    o += QOI_HEADER;
+
+    uint32_t index[64] = {0};
+    uint32_t prev = 0xff000000;
+    for (uint32_t i = 0; i < count;) {
+        uint32_t px = load_pixel(rgba + (size_t)i * 4);
+
+        if (px == prev) {
+            uint32_t run = qoi_run(rgba, i, count, px);
+            i += run;
+            for (; run >= 62; run -= 62)
+                *o++ = QOI_OP_RUN | 61;
+            if (run)
+                *o++ = QOI_OP_RUN | (run - 1);
+            continue;
+        }
+
+        uint32_t hash = qoi_hash(px);
+        if (index[hash] == px) {
+            *o++ = QOI_OP_INDEX | hash;
+        } else {
+            index[hash] = px;
+
+            if ((px ^ prev) >> 24) {
+                *o++ = QOI_OP_RGBA;
+                memcpy(o, rgba + (size_t)i * 4, 4);
+                o += 4;
+            } else {
+                int8_t vr = (px & 0xff) - (prev & 0xff);
+                int8_t vg = (px >> 8 & 0xff) - (prev >> 8 & 0xff);
+                int8_t vb = (px >> 16 & 0xff) - (prev >> 16 & 0xff);
+                int8_t vg_r = vr - vg, vg_b = vb - vg;
+
+                if (vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 &&
+                    vb < 2) {
+                    *o++ = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 |
+                           (vb + 2);
+                } else if (vg_r > -9 && vg_r < 8 && vg > -33 && vg < 32 &&
+                           vg_b > -9 && vg_b < 8) {
+                    *o++ = QOI_OP_LUMA | (vg + 32);
+                    *o++ = (vg_r + 8) << 4 | (vg_b + 8);
+                } else {
+                    *o++ = QOI_OP_RGB;
+                    memcpy(o, rgba + (size_t)i * 4, 3);
+                    o += 3;
+                }
+            }
+        }
+        prev = px;
+        i++;
+    }
+
+    memcpy(o, qoi_padding, sizeof(qoi_padding));
+    o += sizeof(qoi_padding);
+    *len = o - out;
+    return out;
+}
+
+// qoi file to an rgba8 image, false if it's broken
+bool qoi_decode(uint8_t *data, size_t len, Image *image) {
+    if (len < QOI_HEADER + sizeof(qoi_padding) || memcmp(data, "qoif", 4))
+        return false;
+
+    uint32_t width = convert_uint(data + 4);
+    uint32_t height = convert_uint(data + 8);
+    if (width == 0 || height == 0 || data[12] < 3 || data[12] > 4 ||
+        (uint64_t)width * height > QOI_PIXELS_MAX)
+        return false;
+
+    // pixels past the end of a short file stay transparent
+    size_t count = (size_t)width * height;
+    uint8_t *out = calloc(count, 4);
+    uint8_t index[64][4] = {0};
+    uint8_t px[4] = {0, 0, 0, 255};
+    uint32_t run = 0;
+
+    size_t p = QOI_HEADER, end = len - sizeof(qoi_padding);
+    for (size_t i = 0; i < count; i++) {
+        if (run > 0) {
+            run--;
+        } else if (p < end) {
+            uint8_t op = data[p++];
+            if (op == QOI_OP_RGB) {
+                if (p + 3 > end)
+                    break;
+                memcpy(px, data + p, 3);
+                p += 3;
+            } else if (op == QOI_OP_RGBA) {
+                if (p + 4 > end)
+                    break;
+                memcpy(px, data + p, 4);
+                p += 4;
+            } else if ((op & 0xc0) == QOI_OP_INDEX) {
+                memcpy(px, index[op], 4);
+            } else if ((op & 0xc0) == QOI_OP_DIFF) {
+                px[0] += (op >> 4 & 3) - 2;
+                px[1] += (op >> 2 & 3) - 2;
+                px[2] += (op & 3) - 2;
+            } else if ((op & 0xc0) == QOI_OP_LUMA) {
+                if (p >= end)
+                    break;
+                int vg = (op & 0x3f) - 32;
+                uint8_t b2 = data[p++];
+                px[0] += vg - 8 + (b2 >> 4 & 0x0f);
+                px[1] += vg;
+                px[2] += vg - 8 + (b2 & 0x0f);
+            } else {
+                run = op & 0x3f;
+            }
+            memcpy(index[qoi_hash(load_pixel(px))], px, 4);
+        } else {
+            break;
+        }
+        memcpy(out + i * 4, px, 4);
+    }
+
+    *image = (Image){
+        .data = out,
+        .width = width,
+        .height = height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+    return true;
+}
+
+bool is_qoi(const char *path) {
+    char magic[4] = {0};
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    bool qoi = fread(magic, 1, 4, file) == 4 && memcmp(magic, "qoif", 4) == 0;
+    fclose(file);
+    return qoi;
+}
+
+bool read_qoi(const char *path, Image *image) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    fseek(file, 0, SEEK_END);
+    size_t len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    uint8_t *data = malloc(len);
+    bool ok = fread(data, 1, len, file) == len && qoi_decode(data, len, image);
+    fclose(file);
+    free(data);
+    return ok;
+}
+
+bool write_qoi(const char *path, Image image) {
+    size_t len;
+    uint8_t *data = qoi_encode(image.data, image.width, image.height, &len);
+
+    FILE *file = fopen(path, "wb");
+    bool ok = file && fwrite(data, 1, len, file) == len;
+    if (file)
+        ok = fclose(file) == 0 && ok;
+    free(data);
+    return ok;
+}
+
+/*
+ * Screenshots
+ *
+ * The frame is read back on the render thread, everything else happens on a
+ * detached thread so the render loop keeps its frame rate. Screenshots want
+ * speed over size: Sub filter on every row and fast_deflate(), whose runs
+ * are what flat ui like content compresses well with anyway.
+ */
+
+typedef struct {
+    Image image;
+    char path[64];
+} Screenshot;
+
+atomic_int screenshots_pending = 0;
+uint32_t screenshot_count = 0;
+
+void *screenshot_worker(void *arg) {
+    Screenshot *shot = arg;
+    EncodeOptions fast = {
+        .select = SELECT_FIXED,
+        .filter = 1,
+        .fast_deflate = true,
+    };
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    bool ok = poder_encode(shot->path, shot->image.data, shot->image.width,
+                           shot->image.height, COLOR_TRUEALPHA_RGBA, &fast);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ms = (end.tv_sec - start.tv_sec) * 1e3 +
+                (end.tv_nsec - start.tv_nsec) / 1e6;
+    if (ok)
+        printf("%s: %dx%d in %.2fms\n", shot->path, shot->image.width,
+               shot->image.height, ms);
+    else
+        printf("%s: couldn't write screenshot\n", shot->path);
+
+    UnloadImage(shot->image);
+    free(shot);
+    atomic_fetch_sub(&screenshots_pending, 1);
+    return NULL;
+}
+
+// grabs what was drawn so far this frame, call before EndDrawing()
+void take_screenshot(void) {
+    Screenshot *shot = malloc(sizeof(Screenshot));
+    shot->image = LoadImageFromScreen();
+    snprintf(shot->path, sizeof(shot->path), "screenshot_%03u.png",
+             screenshot_count++);
+
+    atomic_fetch_add(&screenshots_pending, 1);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, screenshot_worker, shot) != 0) {
+        screenshot_worker(shot); // no thread, do it here
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// screenshots still being written when the window closes
+void wait_screenshots(void) {
+    while (atomic_load(&screenshots_pending) > 0)
+        usleep(1000);
+}
+
+/*
+ * Optimize
+ *
+ * Lossless recompression: the png is decoded to rgba, every smaller pixel
+ * format it fits into (rgb without alpha, gray, palette, fewer bits) becomes a
+ * candidate, and each candidate is encoded with a few filter selections and
+ * zlib settings. The smallest result is decoded again and must give exactly
+ * the same rgba before it replaces the original.
+ */
+
+#define MAX_CANDIDATES 6
+
+// filter selection, level and strategy tried for every candidate
+static const EncodeOptions optimize_trials[] = {
+    {.level = 9, .select = SELECT_FIXED, .filter = 0},
+    {.level = 9, .select = SELECT_MINSUM},
+    {.level = 9, .select = SELECT_ENTROPY},
+    {.level = 9, .select = SELECT_MINSUM, .strategy = Z_FILTERED},
+    {.level = 9, .select = SELECT_ENTROPY, .strategy = Z_FILTERED},
+    {.level = 6, .select = SELECT_MINSUM},
+};
+#define TRIALS (sizeof(optimize_trials) / sizeof(optimize_trials[0]))
+
+typedef struct {
+    const char *pngfile;
+    bool dry_run;
+
+    uint8_t *rgba; // what every candidate has to decode to
+    uint32_t width;
+    uint32_t height;
+    uint8_t *chunks; // ancillary chunks that don't depend on the color type
+    size_t chunks_len;
+
+    PngImage candidates[MAX_CANDIDATES];
+    uint32_t candidate_count;
+
+    uint8_t *best;
+    size_t best_len;
+    uint32_t best_trial; // candidate * TRIALS + trial
+    pthread_mutex_t lock;
+
+    bool failed;
+    size_t before;
+    size_t after;
+    char result[256];
+} Optimize;
+
+// packs samples of depth bits into rows of png layout
+uint8_t *pack_samples(uint8_t *samples, uint32_t width, uint32_t height,
+                      uint32_t ch, uint32_t depth) {
+    size_t stride = ((size_t)width * ch * depth + 7) / 8;
+    uint8_t *out = calloc(height, stride);
+    for (uint32_t y = 0; y < height; y++) {
+        uint8_t *row = out + y * stride;
+        uint8_t *in = samples + (size_t)y * width * ch;
+        for (size_t i = 0; i < (size_t)width * ch; i++) {
+            if (depth == 8)
+                row[i] = in[i];
+            else
+                row[i * depth / 8] |= in[i] << (8 - depth - i * depth % 8);
+        }
+    }
+    return out;
+}
+
+// smallest of 1, 2, 4 and 8 bits that can hold n values
+uint32_t depth_for(uint32_t n) {
+    return n <= 2 ? 1 : n <= 4 ? 2 : n <= 16 ? 4 : 8;
+}
+
+// copies the ancillary chunks of pngfile that still mean the same thing after
+// the color type changes
+void keep_chunks(const char *pngfile, Optimize *o) {
+    static const char *keep[] = {"gAMA", "cHRM", "sRGB", "iCCP", "cICP",
+                                 "pHYs", "tEXt", "zTXt", "iTXt", "tIME",
+                                 "eXIf", "sPLT", NULL};
+    FILE *file = fopen(pngfile, "rb");
+    if (file == NULL)
+        return;
+
+    FILE *out = open_memstream((char **)&o->chunks, &o->chunks_len);
+    uint8_t head[8];
+    fseek(file, 8, SEEK_SET);
+    while (fread(head, CHAR, 8, file) == 8) {
+        uint32_t length = convert_uint(head);
+        bool copy = false;
+        for (int i = 0; keep[i]; i++)
+            copy |= memcmp(head + 4, keep[i], 4) == 0;
+
+        if (!copy) {
+            fseek(file, length + CRC, SEEK_CUR);
+            continue;
+        }
+
+        uint8_t *chunk = malloc(length + CRC);
+        if (fread(chunk, CHAR, length + CRC, file) == length + CRC) {
+            fwrite(head, CHAR, 8, out);
+            fwrite(chunk, CHAR, length + CRC, out);
+        }
+        free(chunk);
+    }
+
+    fclose(out);
+    fclose(file);
+}
+
+void add_candidates(Optimize *o) {
+    size_t pixels = (size_t)o->width * o->height;
+    uint8_t *rgba = o->rgba;
+
+    bool opaque = true, gray = true;
+    for (size_t i = 0; i < pixels; i++) {
+        uint8_t *p = rgba + i * 4;
+        opaque &= p[3] == 255;
+        gray &= p[0] == p[1] && p[1] == p[2];
+    }
+
+    // palette, transparent colors first so tRNS stays short
+    uint32_t colors[257];
+    uint32_t color_count = 0;
+    uint8_t *index = malloc(pixels);
+    for (size_t i = 0; i < pixels && color_count <= 256; i++) {
+        uint32_t c;
+        memcpy(&c, rgba + i * 4, 4);
+        uint32_t k = 0;
+        while (k < color_count && colors[k] != c)
+            k++;
+        if (k == color_count)
+            colors[color_count++] = c;
+        index[i] = k;
+    }
+
+    PngImage *c = o->candidates;
+    uint32_t n = 0;
+    c[n++] = (PngImage){.pixels = rgba, // freed with the image
+                        .bit_depth = 8,
+                        .color_type = COLOR_TRUEALPHA_RGBA};
+
+    if (opaque) {
+        uint8_t *rgb = malloc(pixels * 3);
+        for (size_t i = 0; i < pixels; i++)
+            memcpy(rgb + i * 3, rgba + i * 4, 3);
+        c[n++] = (PngImage){.pixels = rgb,
+                            .bit_depth = 8,
+                            .color_type = COLOR_TRUE_RGB};
+    }
+
+    if (gray && !opaque) {
+        uint8_t *ga = malloc(pixels * 2);
+        for (size_t i = 0; i < pixels; i++) {
+            ga[i * 2] = rgba[i * 4];
+            ga[i * 2 + 1] = rgba[i * 4 + 3];
+        }
+        c[n++] = (PngImage){.pixels = ga,
+                            .bit_depth = 8,
+                            .color_type = COLOR_GRAYSCALE_ALPHA};
+    }
+
+    if (gray && opaque) {
+        // fewest bits every gray value is exact in, 255 / (2^depth - 1) apart
+        uint32_t depth = 1;
+        for (size_t i = 0; i < pixels; i++)
+            while (depth < 8 && rgba[i * 4] % (255 / ((1 << depth) - 1)) != 0)
+                depth *= 2;
+
+        uint8_t *g = malloc(pixels);
+        for (size_t i = 0; i < pixels; i++)
+            g[i] = rgba[i * 4] / (255 / ((1 << depth) - 1));
+        c[n++] = (PngImage){.pixels = pack_samples(g, o->width, o->height, 1,
+                                                   depth),
+                            .bit_depth = depth,
+                            .color_type = COLOR_GRAYSCALE};
+        free(g);
+    }
+
+    if (color_count <= 256) {
+        uint8_t order[256]; // old index to palette index
+        uint8_t *palette = malloc(256 * 4);
+        uint32_t p = 0;
+        for (int pass = 0; pass < 2; pass++) {
+            for (uint32_t k = 0; k < color_count; k++) {
+                uint8_t *col = (uint8_t *)&colors[k];
+                if ((col[3] == 255) == (pass == 1)) {
+                    memcpy(palette + p * 4, col, 4);
+                    order[k] = p++;
+                }
+            }
+        }
+        for (size_t i = 0; i < pixels; i++)
+            index[i] = order[index[i]];
+
+        uint32_t depth = depth_for(color_count);
+        c[n++] = (PngImage){.pixels = pack_samples(index, o->width, o->height,
+                                                   1, depth),
+                            .bit_depth = depth,
+                            .color_type = COLOR_INDEXED,
+                            .palette = palette,
+                            .palette_size = color_count};
+    }
+    free(index);
+
+    for (uint32_t i = 0; i < n; i++) {
+        c[i].width = o->width;
+        c[i].height = o->height;
+        c[i].chunks = o->chunks;
+        c[i].chunks_len = o->chunks_len;
+    }
+    o->candidate_count = n;
+}
+
+void trial_job(void *arg, uint32_t first, uint32_t last) {
+    Optimize *o = arg;
+    for (uint32_t t = first; t < last; t++) {
+        EncodeOptions opts = optimize_trials[t % TRIALS];
+        opts.strip_rows = o->height; // one stream compresses best
+
+        char *buff = NULL;
+        size_t len = 0;
+        FILE *file = open_memstream(&buff, &len);
+        encode_png(file, &o->candidates[t / TRIALS], &opts);
+        fclose(file);
+
+        pthread_mutex_lock(&o->lock);
+        if (o->best == NULL || len < o->best_len) {
+            free(o->best);
+            o->best = (uint8_t *)buff;
+            o->best_len = len;
+            o->best_trial = t;
+            buff = NULL;
+        }
+        pthread_mutex_unlock(&o->lock);
+        free(buff);
+    }
+}
+
+// decodes the png in buff and compares it to rgba
+bool same_pixels(uint8_t *buff, size_t len, uint8_t *rgba, uint32_t width,
+                 uint32_t height) {
+    FILE *file = fmemopen(buff, len, "rb");
+    PNG png = {0};
+    char err[256];
+    bool ok = read_png_file(file, &png, err, sizeof(err));
+    fclose(file);
+    if (!ok)
+        return false;
+
+    bool same = false;
+    if (png.width == width && png.height == height) {
+        DecodeOptions opts = {.raw_color = true, .err = err,
+                              .errlen = sizeof(err)};
+        Image image = decode_png(&png, &opts);
+        same = image.data &&
+               memcmp(image.data, rgba, (size_t)width * height * 4) == 0;
+        UnloadImage(image);
+    }
+    free_png(&png);
+    return same;
+}
+
+// transparency a png declares, read straight from its chunks so it doesn't
+// lean on the decoder. a tRNS only counts if something in it isn't opaque
+typedef struct {
+    bool channel; // gray+alpha or rgba
+    bool trns;
+} Transparency;
+
+Transparency declared_alpha(FILE *file) {
+    Transparency t = {0};
+    uint8_t head[8], color_type = 0;
+    fseek(file, 8, SEEK_SET);
+    while (fread(head, CHAR, 8, file) == 8) {
+        uint32_t length = convert_uint(head);
+        if (memcmp(head + 4, "IHDR", 4) == 0 && length == 13) {
+            uint8_t ihdr[13];
+            if (fread(ihdr, CHAR, 13, file) != 13)
+                break;
+            color_type = ihdr[9];
+            t.channel = color_type == COLOR_GRAYSCALE_ALPHA ||
+                        color_type == COLOR_TRUEALPHA_RGBA;
+            fseek(file, CRC, SEEK_CUR);
+        } else if (memcmp(head + 4, "tRNS", 4) == 0 && length <= 256) {
+            uint8_t trns[256];
+            if (fread(trns, CHAR, length, file) != length)
+                break;
+            // a key is transparent wherever it matches, assume it does
+            t.trns = color_type != COLOR_INDEXED && length > 0;
+            for (uint32_t i = 0; i < length; i++)
+                t.trns |= trns[i] != 255;
+            fseek(file, CRC, SEEK_CUR);
+        } else {
+            fseek(file, length + CRC, SEEK_CUR);
+        }
+    }
+    return t;
+}
+
+// whether the candidate in o->best drops transparency the source had. an
+// alpha channel may only go if the decoded pixels are all opaque
+bool loses_alpha(Optimize *o) {
+    FILE *file = fopen(o->pngfile, "rb");
+    if (!file)
+        return true;
+    Transparency before = declared_alpha(file);
+    fclose(file);
+
+    file = fmemopen(o->best, o->best_len, "rb");
+    Transparency after = declared_alpha(file);
+    fclose(file);
+
+    size_t pixels = (size_t)o->width * o->height;
+    bool needed = before.trns ||
+                  (before.channel && qoi_channels(o->rgba, pixels) == 4);
+    return needed && !after.channel && !after.trns;
+}
+
+void optimize_png(Optimize *o, bool parallel_trials) {
+    const char *pngfile = o->pngfile;
+
+    if (!verify_png(pngfile, o->result, sizeof(o->result))) {
+        o->failed = true;
+        return;
+    }
+
+    FILE *file = fopen(pngfile, "rb");
+    fseek(file, 0, SEEK_END);
+    o->before = o->after = ftell(file);
+    fclose(file);
+
+    PNG png = {0};
+    if (!load_png(pngfile, &png, o->result, sizeof(o->result))) {
+        o->failed = true;
+        return;
+    }
+    if (png.bit_depth == 16 || png.interlace || png.frame_count) {
+        snprintf(o->result, sizeof(o->result), "skipped, %s",
+                 png.frame_count ? "animated"
+                 : png.interlace ? "interlaced"
+                                 : "16 bit");
+        free_png(&png);
+        return;
+    }
+
+    // the color chunks are kept, so the samples have to stay as they are
+    DecodeOptions decode = {.raw_color = true, .err = o->result,
+                            .errlen = sizeof(o->result)};
+    Image image = decode_png(&png, &decode);
+    free_png(&png);
+    if (!image.data) {
+        o->failed = true;
+        return;
+    }
+
+    o->rgba = image.data;
+    o->width = image.width;
+    o->height = image.height;
+    pthread_mutex_init(&o->lock, NULL);
+
+    keep_chunks(pngfile, o);
+    add_candidates(o);
+
+    uint32_t trials = o->candidate_count * TRIALS;
+    if (parallel_trials)
+        parallel_for(trials, 1, trial_job, o);
+    else
+        trial_job(o, 0, trials);
+
+    PngImage *best = &o->candidates[o->best_trial / TRIALS];
+    const EncodeOptions *trial = &optimize_trials[o->best_trial % TRIALS];
+
+    char filter[16];
+    static const char *selects[] = {"minsum", "entropy", "brute", "filter"};
+    if (trial->select == SELECT_FIXED)
+        snprintf(filter, sizeof(filter), "filter %u", trial->filter);
+    else
+        snprintf(filter, sizeof(filter), "%s", selects[trial->select]);
+
+    // same_pixels() shares the decoder with the source, so a decoder bug
+    // would pass it. the alpha check doesn't
+    if (!same_pixels(o->best, o->best_len, o->rgba, o->width, o->height)) {
+        o->failed = true;
+        snprintf(o->result, sizeof(o->result), "not pixel identical, kept");
+    } else if (loses_alpha(o)) {
+        o->failed = true;
+        snprintf(o->result, sizeof(o->result), "would lose alpha, kept");
+    } else if (o->best_len >= o->before) {
+        snprintf(o->result, sizeof(o->result), "%zu bytes, already smallest",
+                 o->before);
+    } else {
+        o->after = o->best_len;
+        snprintf(o->result, sizeof(o->result),
+                 "%zu -> %zu bytes (%.1f%%), color type %u, %u bit, %s, "
+                 "level %d%s",
+                 o->before, o->after,
+                 100.0 * (o->before - o->after) / o->before, best->color_type,
+                 best->bit_depth, filter, trial->level,
+                 trial->strategy == Z_FILTERED ? ", Z_FILTERED" : "");
+
+        if (!o->dry_run) {
+            char tmp[4096];
+            snprintf(tmp, sizeof(tmp), "%s.tmp", pngfile);
+            FILE *out = fopen(tmp, "wb");
+            bool ok = out && fwrite(o->best, CHAR, o->best_len, out) ==
+                                 o->best_len;
+            if (out)
+                ok = fclose(out) == 0 && ok;
+            if (!ok || rename(tmp, pngfile) != 0) {
+                remove(tmp);
+                o->after = o->before;
+                snprintf(o->result, sizeof(o->result), "couldn't write: %s",
+                         strerror(errno));
+            }
+        }
+    }
+
+    for (uint32_t i = 1; i < o->candidate_count; i++) {
+        free(o->candidates[i].pixels);
+        free(o->candidates[i].palette);
+    }
+    free(o->chunks);
+    free(o->best);
+    UnloadImage(image);
+    pthread_mutex_destroy(&o->lock);
+}
+
+void optimize_job(void *arg, uint32_t first, uint32_t last) {
+    Optimize *o = arg;
+    for (uint32_t i = first; i < last; i++)
+        optimize_png(&o[i], false);
+}
+
+// optimizes files in place, returns how many couldn't be optimized
+uint32_t optimize_files(char **files, uint32_t count, bool dry_run) {
+    Optimize *o = calloc(count, sizeof(Optimize));
+    for (uint32_t i = 0; i < count; i++) {
+        o[i].pngfile = files[i];
+        o[i].dry_run = dry_run;
+    }
+
+    // one file spreads its trials over the cores, many files spread
+    // themselves
+    if (count == 1)
+        optimize_png(&o[0], true);
+    else
+        parallel_for(count, 1, optimize_job, o);
+
+    uint32_t failed = 0;
+    size_t before = 0, after = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        printf("%s: %s\n", files[i], o[i].result);
+        failed += o[i].failed;
+        before += o[i].before;
+        after += o[i].after;
+    }
+
+    printf("%u files, %zu -> %zu bytes, saved %zu (%.1f%%)%s\n", count, before,
+           after, before - after,
+           before ? 100.0 * (before - after) / before : 0.0,
+           dry_run ? " (dry run)" : "");
+
+    free(o);
+    return failed;
+}
+
+/*
+ * Strip
+ *
+ * Rewrites a png with only the chunks asked for, without looking inside any
+ * of them. chunks that change the pixels (tRNS, the color chunks and APNG's)
+ * stay unless they're dropped by name. Kept chunks are copied file to file by the kernel with
+ * copy_file_range() (or sendfile() where that doesn't work), CRC included.
+ * Merged IDATs need a new CRC, but since crc(type + data) = crc(data) ^
+ * crc32_combine(crc(type), 0, len) the CRC of each payload falls out of its
+ * stored CRC and they combine without reading the payload at all.
+ */
+
+#define MAX_CHUNK 0x7fffffff
+
+typedef struct {
+    char **keep; // ancillary chunk types to keep, critical ones always are
+    uint32_t keep_count;
+    char **drop; // pixel chunks to drop anyway
+    uint32_t drop_count;
+    bool merge_idat;
+    const char *outfile; // NULL rewrites in place
+} StripOptions;
+
+// ancillary chunks that change what the image looks like
+bool affects_pixels(const char *type) {
+    static const char *pixels[] = {"tRNS", "gAMA", "cHRM", "sRGB", "iCCP",
+                                   "cICP", "acTL", "fcTL", "fdAT", NULL};
+    for (int i = 0; pixels[i]; i++)
+        if (strcmp(type, pixels[i]) == 0)
+            return true;
+    return false;
+}
+
+// copies len bytes at offset of in to the end of out
+bool copy_range(int in, off_t offset, int out, size_t len) {
+    while (len > 0) {
+        ssize_t n = copy_file_range(in, &offset, out, NULL, len, 0);
+        if (n <= 0)
+            break;
+        len -= n;
+    }
+    while (len > 0) {
+        ssize_t n = sendfile(out, in, &offset, len);
+        if (n <= 0)
+            break;
+        len -= n;
+    }
+    while (len > 0) { // plain copy as last resort
+        uint8_t buff[65536];
+        ssize_t n = pread(in, buff, len < sizeof(buff) ? len : sizeof(buff),
+                          offset);
+        if (n <= 0 || write(out, buff, n) != n)
+            return false;
+        offset += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool write_all(int fd, void *buff, size_t len) {
+    // a single write stops short of 2G
+    for (size_t done = 0; done < len;) {
+        ssize_t n = write(fd, (uint8_t *)buff + done, len - done);
+        if (n <= 0)
+            return false;
+        done += n;
+    }
+    return true;
+}
+
+typedef struct {
+    off_t offset; // of the data
+    uint32_t length;
+    uint32_t crc; // crc of the data alone
+} Idat;
+
+// writes the IDATs as one chunk, returns false on error
+bool write_merged_idat(int in, int out, Idat *idats, uint32_t count) {
+    uint64_t total = 0;
+    uLong crc = crc32(0, (const Bytef *)"IDAT", 4);
+    for (uint32_t i = 0; i < count; i++) {
+        total += idats[i].length;
+        crc = crc32_combine(crc, idats[i].crc, idats[i].length);
+    }
+
+    uint8_t head[8];
+    uint32_t n = __builtin_bswap32(total);
+    memcpy(head, &n, 4);
+    memcpy(head + 4, "IDAT", 4);
+    if (!write_all(out, head, 8))
+        return false;
+
+    for (uint32_t i = 0; i < count; i++)
+        if (!copy_range(in, idats[i].offset, out, idats[i].length))
+            return false;
+
+    n = __builtin_bswap32(crc);
+    return write_all(out, &n, 4);
+}
+
+bool strip_png(const char *pngfile, StripOptions *opts, char *result,
+               size_t len) {
+    int in = open(pngfile, O_RDONLY);
+    if (in < 0) {
+        snprintf(result, len, "%s", strerror(errno));
+        return false;
+    }
+
+    char outfile[4096];
+    if (opts->outfile)
+        snprintf(outfile, sizeof(outfile), "%s", opts->outfile);
+    else
+        snprintf(outfile, sizeof(outfile), "%s.tmp", pngfile);
+
+    int out = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        snprintf(result, len, "%s: %s", outfile, strerror(errno));
+        close(in);
+        return false;
+    }
+
+    bool ok = false;
+    uint32_t dropped = 0, idat_in = 0, idat_out = 0;
+    Idat *idats = NULL;
+    uint32_t idat_count = 0, idat_cap = 0;
+    uint64_t idat_bytes = 0;
+
+    uint8_t sig[8];
+    static const uint8_t png_sig[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A,
+                                       0x1A, 0x0A};
+    if (pread(in, sig, 8, 0) != 8 || memcmp(sig, png_sig, 8) != 0) {
+        snprintf(result, len, "invalid PNG signature");
+        goto out;
+    }
+    if (!write_all(out, sig, 8))
+        goto write_error;
+
+    off_t offset = 8;
+    uint8_t head[8];
+    while (pread(in, head, 8, offset) == 8) {
+        uint32_t length = convert_uint(head);
+        char type[5];
+        memcpy(type, head + 4, 4);
+        type[4] = '\0';
+
+        bool is_idat = strcmp(type, "IDAT") == 0;
+        bool keep = !(type[0] & 0x20) || affects_pixels(type);
+        for (uint32_t i = 0; i < opts->keep_count; i++)
+            keep |= strcmp(type, opts->keep[i]) == 0;
+        for (uint32_t i = 0; i < opts->drop_count; i++)
+            keep &= !(type[0] & 0x20) || strcmp(type, opts->drop[i]) != 0;
+
+        // pending IDATs go out before the next chunk that isn't one
+        if (!is_idat && idat_count) {
+            if (!write_merged_idat(in, out, idats, idat_count))
+                goto write_error;
+            idat_count = 0;
+            idat_bytes = 0;
+            idat_out++;
+        }
+
+        if (is_idat && opts->merge_idat) {
+            uint8_t stored[4];
+            if (pread(in, stored, 4, offset + 8 + length) != 4) {
+                snprintf(result, len, "IDAT at offset %ld: truncated",
+                         (long)offset);
+                goto out;
+            }
+
+            if (idat_bytes + length > MAX_CHUNK) {
+                if (!write_merged_idat(in, out, idats, idat_count))
+                    goto write_error;
+                idat_count = 0;
+                idat_bytes = 0;
+                idat_out++;
+            }
+
+            if (idat_count == idat_cap) {
+                idat_cap = idat_cap ? idat_cap * 2 : 64;
+                idats = realloc(idats, idat_cap * sizeof(Idat));
+            }
+            uLong type_crc = crc32(0, head + 4, 4);
+            idats[idat_count++] = (Idat){
+                .offset = offset + 8,
+                .length = length,
+                .crc = convert_uint(stored) ^
+                       crc32_combine(type_crc, 0, length),
+            };
+            idat_bytes += length;
+            idat_in++;
+        } else if (keep) {
+            if (!copy_range(in, offset, out, 12 + (size_t)length))
+                goto write_error;
+        } else {
+            dropped++;
+        }
+
+        offset += 12 + (off_t)length;
+        if (strcmp(type, "IEND") == 0)
+            break;
+    }
+
+    struct stat st;
+    fstat(in, &st);
+    off_t size = lseek(out, 0, SEEK_CUR);
+
+    if (opts->merge_idat)
+        snprintf(result, len,
+                 "%ld -> %ld bytes, %u chunks dropped, %u IDATs merged into %u",
+                 (long)st.st_size, (long)size, dropped, idat_in, idat_out);
+    else
+        snprintf(result, len, "%ld -> %ld bytes, %u chunks dropped",
+                 (long)st.st_size, (long)size, dropped);
+    ok = true;
+    goto out;
+
+write_error:
+    snprintf(result, len, "%s: %s", outfile, strerror(errno));
+
+out:
+    free(idats);
+    close(in);
+    if (close(out) != 0)
+        ok = false;
+
+    if (!ok) {
+        remove(outfile);
+    } else if (!opts->outfile && rename(outfile, pngfile) != 0) {
+        snprintf(result, len, "%s", strerror(errno));
+        remove(outfile);
+        ok = false;
+    }
+    return ok;
+}
+
+// returns how many files failed
+uint32_t strip_files(char **files, uint32_t count, StripOptions *opts) {
+    if (opts->outfile && count > 1)
+        panic("-o only works with a single file");
+
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        char result[256];
+        failed += !strip_png(files[i], opts, result, sizeof(result));
+        printf("%s: %s\n", files[i], result);
+    }
+    return failed;
+}
+
+/*
+ * Animation
+ *
+ * APNG frames get composited in order on a worker thread into a ring of
+ * canvases that render() uploads when the frame delay is up. every frame
+ * depends on the canvas the previous one left behind, so the worker only ever
+ * runs ahead and restarts from a blank canvas when the animation loops. if
+ * all frames fit into FRAME_CACHE they are composited once and kept.
+ */
+
+#define FRAME_CACHE (256 << 20)
+
+typedef struct {
+    PNG *png;
+    size_t canvas_size;
+
+    uint32_t slots;  // composited frames kept around, slot = seq % slots
+    uint8_t **cache;
+    bool all_cached; // slots == frame_count and the first loop is done
+
+    uint8_t *canvas; // worker's canvas, before dispose of the current frame
+    uint8_t *saved;  // area under a DISPOSE_PREVIOUS frame
+
+    uint64_t produced; // frames composited, counting every loop
+    uint64_t shown;    // sequence number of the frame on screen
+    double next_time;  // when to switch to shown + 1
+    bool started;      // frame 0 was uploaded
+    bool reported;     // a frame failed to decode and it was printed
+    bool quit;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t worker;
+} Animation;
+
+// frame delay in seconds, a zero denominator means 1/100
+double frame_delay(Frame *frame) {
+    return (double)frame->delay_num / (frame->delay_den ? frame->delay_den : 100);
+}
+
+// non-premultiplied over in float, blend_over_row() does the same math 4
+// pixels at a time so the results match exactly
+void blend_over_pixel(uint8_t *dst, uint8_t *src) {
+    const float inv255 = 1.0f / 255;
+    if (src[3] == 255) {
+        memcpy(dst, src, 4);
+        return;
+    }
+    if (src[3] == 0)
+        return;
+
+    float sa = src[3] * inv255;
+    float k = dst[3] * inv255 * (1 - sa); // what is left of dst
+    float oa = fmaxf(sa + k, 1e-6f);
+    for (int c = 0; c < 3; c++)
+        dst[c] = lrintf((src[c] * sa + dst[c] * k) / oa);
+    dst[3] = lrintf(oa * 255);
+}
+
+// APNG_BLEND_OP_OVER of count pixels. runs of opaque or fully transparent
+// source pixels are copied or skipped 4 at a time, mixed ones get blended with
+// one pixel per float vector
+void blend_over_row(uint8_t *dst, uint8_t *src, uint32_t count) {
+    uint32_t x = 0;
+#ifdef __SSE2__
+    if (kernels.isa >= ISA_SSE2) {
+        const __m128i alpha = _mm_set1_epi32(0xff000000);
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i color = _mm_set_epi32(0, -1, -1, -1);
+        const __m128 inv255 = _mm_set1_ps(1.0f / 255);
+        const __m128 one = _mm_set1_ps(1);
+        const __m128 tiny = _mm_set1_ps(1e-6f);
+
+        for (; x + 4 <= count; x += 4) {
+            __m128i s = _mm_loadu_si128((__m128i *)(src + x * 4));
+            __m128i a = _mm_and_si128(s, alpha);
+            __m128i opaque = _mm_cmpeq_epi32(a, alpha);
+            __m128i clear = _mm_cmpeq_epi32(a, zero);
+            if (_mm_movemask_epi8(clear) == 0xffff)
+                continue;
+            if (_mm_movemask_epi8(opaque) == 0xffff) {
+                _mm_storeu_si128((__m128i *)(dst + x * 4), s);
+                continue;
+            }
+
+            __m128i d = _mm_loadu_si128((__m128i *)(dst + x * 4));
+            __m128i s16[2] = {_mm_unpacklo_epi8(s, zero),
+                              _mm_unpackhi_epi8(s, zero)};
+            __m128i d16[2] = {_mm_unpacklo_epi8(d, zero),
+                              _mm_unpackhi_epi8(d, zero)};
+            __m128i out[4];
+            for (int i = 0; i < 4; i++) {
+                __m128i sp = i & 1 ? _mm_unpackhi_epi16(s16[i / 2], zero)
+                                   : _mm_unpacklo_epi16(s16[i / 2], zero);
+                __m128i dp = i & 1 ? _mm_unpackhi_epi16(d16[i / 2], zero)
+                                   : _mm_unpacklo_epi16(d16[i / 2], zero);
+                __m128 sf = _mm_cvtepi32_ps(sp);
+                __m128 df = _mm_cvtepi32_ps(dp);
+
+                __m128 sa = _mm_mul_ps(_mm_shuffle_ps(sf, sf, 0xff), inv255);
+                __m128 k = _mm_mul_ps(_mm_mul_ps(_mm_shuffle_ps(df, df, 0xff),
+                                                 inv255),
+                                      _mm_sub_ps(one, sa));
+                __m128 oa = _mm_max_ps(_mm_add_ps(sa, k), tiny);
+                __m128 c = _mm_div_ps(
+                    _mm_add_ps(_mm_mul_ps(sf, sa), _mm_mul_ps(df, k)), oa);
+
+                __m128i ci = _mm_cvtps_epi32(c);
+                __m128i ai = _mm_cvtps_epi32(_mm_mul_ps(oa, _mm_set1_ps(255)));
+                out[i] = _mm_or_si128(_mm_and_si128(color, ci),
+                                      _mm_andnot_si128(color, ai));
+            }
+            __m128i r = _mm_packus_epi16(_mm_packs_epi32(out[0], out[1]),
+                                         _mm_packs_epi32(out[2], out[3]));
+
+            // opaque pixels are copied, transparent ones leave dst alone
+            r = _mm_or_si128(_mm_and_si128(opaque, s),
+                             _mm_andnot_si128(opaque, r));
+            r = _mm_or_si128(_mm_and_si128(clear, d),
+                             _mm_andnot_si128(clear, r));
+            _mm_storeu_si128((__m128i *)(dst + x * 4), r);
+        }
+    }
+#endif
+    for (; x < count; x++)
+        blend_over_pixel(dst + x * 4, src + x * 4);
+}
+
+// decodes frame i and draws it onto the canvas
+void composite_frame(Animation *anim, uint32_t i) {
+    PNG *png = anim->png;
+    Frame *frame = &png->frames[i];
+    size_t canvas_stride = (size_t)png->width * 4;
+    size_t row_size = (size_t)frame->width * 4;
+    uint8_t *area = anim->canvas + frame->y * canvas_stride + frame->x * 4;
+
+    if (i == 0)
+        memset(anim->canvas, 0, anim->canvas_size);
+
+    if (frame->dispose == DISPOSE_PREVIOUS)
+        for (uint32_t y = 0; y < frame->height; y++)
+            memcpy(anim->saved + y * row_size, area + y * canvas_stride,
+                   row_size);
+
+    // frame is a small png of its own
+    PNG sub = *png;
+    sub.width = frame->width;
+    sub.height = frame->height;
+    sub.data = frame->data;
+    sub.data_t = frame->data_t;
+
+    // a frame that doesn't decode leaves the canvas as it was
+    char err[256];
+    DecodeOptions opts = {.err = err, .errlen = sizeof(err)};
+    Image image = decode_png(&sub, &opts);
+    uint8_t *src = image.data;
+    if (src == NULL) {
+        if (!anim->reported)
+            printf("APNG frame %u: %s\n", i, err);
+        anim->reported = true;
+        return;
+    }
+
+    for (uint32_t y = 0; y < frame->height; y++) {
+        if (frame->blend == BLEND_OVER)
+            blend_over_row(area + y * canvas_stride, src + y * row_size,
+                           frame->width);
+        else
+            memcpy(area + y * canvas_stride, src + y * row_size, row_size);
+    }
+    UnloadImage(image);
+}
+
+// undoes frame i once it was shown, the first frame can't restore anything
+void dispose_frame(Animation *anim, uint32_t i) {
+    Frame *frame = &anim->png->frames[i];
+    size_t canvas_stride = (size_t)anim->png->width * 4;
+    size_t row_size = (size_t)frame->width * 4;
+    uint8_t *area = anim->canvas + frame->y * canvas_stride + frame->x * 4;
+
+    uint8_t dispose = frame->dispose;
+    if (dispose == DISPOSE_PREVIOUS && i == 0)
+        dispose = DISPOSE_BACKGROUND;
+
+    for (uint32_t y = 0; y < frame->height; y++) {
+        if (dispose == DISPOSE_BACKGROUND)
+            memset(area + y * canvas_stride, 0, row_size);
+        else if (dispose == DISPOSE_PREVIOUS)
+            memcpy(area + y * canvas_stride, anim->saved + y * row_size,
+                   row_size);
+    }
+}
+
+void *animation_worker(void *p) {
+    Animation *anim = p;
+    uint32_t count = anim->png->frame_count;
+
+    while (true) {
+        pthread_mutex_lock(&anim->lock);
+        while (!anim->quit && (anim->produced >= anim->shown + anim->slots ||
+                               anim->all_cached))
+            pthread_cond_wait(&anim->cond, &anim->lock);
+        bool quit = anim->quit;
+        uint64_t seq = anim->produced;
+        pthread_mutex_unlock(&anim->lock);
+        if (quit)
+            break;
+
+        // the slot is free, render() is at least one frame past it
+        uint32_t i = seq % count;
+        composite_frame(anim, i);
+        memcpy(anim->cache[seq % anim->slots], anim->canvas,
+               anim->canvas_size);
+        dispose_frame(anim, i);
+
+        pthread_mutex_lock(&anim->lock);
+        anim->produced++;
+        if (anim->slots == count && anim->produced == count)
+            anim->all_cached = true;
+        pthread_cond_broadcast(&anim->cond);
+        pthread_mutex_unlock(&anim->lock);
+    }
+    return NULL;
+}
+
+Animation *animation_start(PNG *png) {
+    if (png->frame_count < 2 || png->interlace)
+        return NULL;
+
+    Animation *anim = calloc(1, sizeof(Animation));
+    anim->png = png;
+    anim->canvas_size = (size_t)png->width * png->height * 4;
+
+    size_t fit = FRAME_CACHE / anim->canvas_size;
+    anim->slots = fit < png->frame_count ? fit : png->frame_count;
+    if (anim->slots < 2)
+        anim->slots = 2;
+
+    anim->cache = malloc(anim->slots * sizeof(uint8_t *));
+    for (uint32_t i = 0; i < anim->slots; i++)
+        anim->cache[i] = malloc(anim->canvas_size);
+    anim->canvas = malloc(anim->canvas_size);
+    anim->saved = malloc(anim->canvas_size);
+
+    pthread_mutex_init(&anim->lock, NULL);
+    pthread_cond_init(&anim->cond, NULL);
+    if (pthread_create(&anim->worker, NULL, animation_worker, anim) != 0)
+        panic("Couldn't start the animation thread");
+
+    return anim;
+}
+
+// copies the next frame into pixels when its time has come and it's
+// composited already, otherwise the current one just stays up a bit longer.
+// returns true if pixels changed
+bool animation_update(Animation *anim, uint8_t *pixels) {
+    PNG *png = anim->png;
+    double now = GetTime();
+
+    pthread_mutex_lock(&anim->lock);
+    uint64_t next = anim->started ? anim->shown + 1 : 0;
+    bool done = png->plays && next >= (uint64_t)png->plays * png->frame_count;
+    bool ready = anim->all_cached || next < anim->produced;
+    pthread_mutex_unlock(&anim->lock);
+
+    if (done || !ready || now < anim->next_time)
+        return false;
+
+    uint32_t i = next % png->frame_count;
+    memcpy(pixels, anim->cache[next % anim->slots], anim->canvas_size);
+    anim->next_time = now + frame_delay(&png->frames[i]);
+    anim->started = true;
+
+    pthread_mutex_lock(&anim->lock);
+    anim->shown = next;
+    pthread_cond_broadcast(&anim->cond);
+    pthread_mutex_unlock(&anim->lock);
+    return true;
+}
+
+// the last play is over, nothing is going to change anymore
+bool animation_done(Animation *anim) {
+    PNG *png = anim->png;
+    return png->plays && anim->started &&
+           anim->shown + 1 >= (uint64_t)png->plays * png->frame_count;
+}
+
+void animation_stop(Animation *anim) {
+    pthread_mutex_lock(&anim->lock);
+    anim->quit = true;
+    pthread_cond_broadcast(&anim->cond);
+    pthread_mutex_unlock(&anim->lock);
+    pthread_join(anim->worker, NULL);
+
+    for (uint32_t i = 0; i < anim->slots; i++)
+        free(anim->cache[i]);
+    free(anim->cache);
+    free(anim->canvas);
+    free(anim->saved);
+    pthread_mutex_destroy(&anim->lock);
+    pthread_cond_destroy(&anim->cond);
+    free(anim);
+}
+
+/*
+ * Disk cache
+ *
+ * decoded RGBA8 pixels of a png kept in a directory, one file per png keyed by
+ * device, inode, size and mtime. a hit is mmapped and used as is, so it costs
+ * page faults instead of inflate and recon. the header takes a whole page so
+ * the pixels are page aligned. files are written to a temp name and renamed,
+ * other viewers can share the directory. a hit touches the mtime, and past
+ * the budget the files with the oldest mtime go.
+ */
+
+#define RAW_MAGIC "PODRAW02"
+#define RAW_HEADER 4096
+#define DISK_CACHE_BUDGET ((size_t)4 << 30)
+
+typedef struct {
+    char magic[8];
+    uint64_t dev; // the png it was decoded from
+    uint64_t ino;
+    uint64_t size;
+    uint64_t mtime_ns;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+} RawHeader;
+
+typedef struct {
+    const char *dir;
+    size_t budget;
+} DiskCache;
+
+// images with mapped pixels, free_image() unmaps those
+typedef struct {
+    void *data;
+    size_t size;
+} Mapping;
+
+Mapping *mappings = NULL;
+uint32_t mapping_count = 0;
+uint32_t mapping_cap = 0;
+pthread_mutex_t mappings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// UnloadImage() that also knows about disk cache hits
+void free_image(Image image) {
+    pthread_mutex_lock(&mappings_lock);
+    for (uint32_t i = 0; i < mapping_count; i++) {
+        if (mappings[i].data == image.data) {
+            munmap((uint8_t *)image.data - RAW_HEADER, mappings[i].size);
+            mappings[i] = mappings[--mapping_count];
+            pthread_mutex_unlock(&mappings_lock);
+            return;
+        }
+    }
+    pthread_mutex_unlock(&mappings_lock);
+    UnloadImage(image);
+}
+
+// maps a cache file and registers it with free_image(), returns what comes
+// after the header or NULL
+void *disk_cache_map(int fd, size_t size) {
+    // private so writes into the image never reach the file
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        return NULL;
+
+    uint8_t *data = (uint8_t *)map + RAW_HEADER;
+    pthread_mutex_lock(&mappings_lock);
+    if (mapping_count == mapping_cap) {
+        mapping_cap = mapping_cap ? mapping_cap * 2 : 16;
+        mappings = realloc(mappings, mapping_cap * sizeof(Mapping));
+    }
+    mappings[mapping_count++] = (Mapping){data, size};
+    pthread_mutex_unlock(&mappings_lock);
+    return data;
+}
+
+// fills in the key fields, false if the png can't be stat'ed
+bool raw_key(const char *pngfile, RawHeader *header, char *path, size_t len,
+             DiskCache *cache) {
+    struct stat st;
+    if (stat(pngfile, &st) != 0)
+        return false;
+
+    *header = (RawHeader){
+        .magic = RAW_MAGIC,
+        .dev = st.st_dev,
+        .ino = st.st_ino,
+        .size = st.st_size,
+        .mtime_ns = st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec,
+    };
+
+    // FNV-1a of the key
+    uint64_t hash = 0xcbf29ce484222325ull;
+    uint8_t *key = (uint8_t *)&header->dev;
+    for (size_t i = 0; i < 4 * sizeof(uint64_t); i++)
+        hash = (hash ^ key[i]) * 0x100000001b3ull;
+
+    snprintf(path, len, "%s/%016llx.raw", cache->dir,
+             (unsigned long long)hash);
+    return true;
+}
+
+bool disk_cache_load(DiskCache *cache, const char *pngfile, Image *image) {
+    RawHeader key, header;
+    char path[4096];
+    if (!raw_key(pngfile, &key, path, sizeof(path), cache))
+        return false;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    bool ok = pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+              memcmp(&header, &key, offsetof(RawHeader, width)) == 0 &&
+              header.format == PIXELFORMAT_UNCOMPRESSED_R8G8B8A8 &&
+              fstat(fd, &st) == 0 &&
+              st.st_size ==
+                  RAW_HEADER + (off_t)header.width * header.height * 4;
+
+    void *data = NULL;
+    if (ok) {
+        data = disk_cache_map(
+            fd, RAW_HEADER + (size_t)header.width * header.height * 4);
+        futimens(fd, NULL); // recently used
+    }
+    close(fd);
+    if (data == NULL)
+        return false;
+
+    *image = (Image){
+        .data = data,
+        .width = header.width,
+        .height = header.height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+    return true;
+}
+
+typedef struct {
+    char *path;
+    size_t size;
+    struct timespec mtime;
+} RawFile;
+
+int compare_mtime(const void *a, const void *b) {
+    const struct timespec *x = &((RawFile *)a)->mtime;
+    const struct timespec *y = &((RawFile *)b)->mtime;
+    if (x->tv_sec != y->tv_sec)
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    return (x->tv_nsec > y->tv_nsec) - (x->tv_nsec < y->tv_nsec);
+}
+
+// deletes the least recently used files until the cache fits its budget
+void disk_cache_evict(DiskCache *cache) {
+    DIR *dir = opendir(cache->dir);
+    if (dir == NULL)
+        return;
+
+    uint32_t count = 0, cap = 64;
+    RawFile *files = malloc(cap * sizeof(RawFile));
+    size_t total = 0;
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        // decoded pixels and compressed tiles
+        const char *ext = strrchr(entry->d_name, '.');
+        if (!ext || (strcmp(ext, ".raw") != 0 && strcmp(ext, ".bc") != 0))
+            continue;
+
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, entry->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0)
+            continue;
+
+        if (count == cap)
+            files = realloc(files, (cap *= 2) * sizeof(RawFile));
+        files[count++] = (RawFile){strdup(path), st.st_size, st.st_mtim};
+        total += st.st_size;
+    }
+    closedir(dir);
+
+    qsort(files, count, sizeof(RawFile), compare_mtime);
+    for (uint32_t i = 0; i < count; i++) {
+        if (total > cache->budget && unlink(files[i].path) == 0)
+            total -= files[i].size;
+        free(files[i].path);
+    }
+    free(files);
+}
+
+// writes header in a page of its own and then data to path, through a temp
+// file so nobody maps half of it
+void disk_cache_write(DiskCache *cache, const char *path, void *header,
+                      size_t header_size, void *data, size_t size) {
+    char tmp[4200];
+    mkdir(cache->dir, 0755);
+    snprintf(tmp, sizeof(tmp), "%s.%d.%lu.tmp", path, getpid(),
+             (unsigned long)pthread_self());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return;
+
+    uint8_t page[RAW_HEADER] = {0};
+    memcpy(page, header, header_size);
+    bool ok = write_all(fd, page, RAW_HEADER) && write_all(fd, data, size);
+    close(fd);
+
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return;
+    }
+    disk_cache_evict(cache);
+}
+
+void disk_cache_store(DiskCache *cache, const char *pngfile, Image image) {
+    RawHeader header;
+    char path[4096];
+    if (!raw_key(pngfile, &header, path, sizeof(path), cache) ||
+        access(path, F_OK) == 0)
+        return;
+
+    header.width = image.width;
+    header.height = image.height;
+    header.format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8;
+    disk_cache_write(cache, path, &header, sizeof(header), image.data,
+                     (size_t)image.width * image.height * 4);
+}
+
+/*
+ * Mipmaps
+ *
+ * every level is a 2x2 box filter of the one above, max(1, size / 2) like GL
+ * does it so tiles can carry their own chain. with gamma the average is taken
+ * in linear light, which keeps bright detail from turning muddy when zoomed
+ * out. alpha is always averaged as is.
+ */
+
+uint16_t srgb_to_linear[256]; // 0..65535
+uint8_t linear_to_srgb[4096]; // by linear >> 4
+pthread_once_t gamma_once = PTHREAD_ONCE_INIT;
+
+void init_gamma(void) {
+    for (int i = 0; i < 256; i++) {
+        float c = i / 255.f;
+        c = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+        srgb_to_linear[i] = lrintf(c * 65535);
+    }
+    for (int i = 0; i < 4096; i++) {
+        float c = (i + 0.5f) / 4096;
+        c = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+        linear_to_srgb[i] = lrintf(c * 255);
+    }
+}
+
+// rows [first, last) of the half size image, src rows are width * 4 apart
+void downsample_rows(uint8_t *src, uint32_t width, uint32_t height,
+                     uint8_t *dst, uint32_t first, uint32_t last, bool gamma) {
+    uint32_t out_width = width > 1 ? width / 2 : 1;
+    size_t stride = (size_t)width * 4;
+
+    for (uint32_t y = first; y < last; y++) {
+        uint8_t *r0 = src + (size_t)y * 2 * stride;
+        uint8_t *r1 = y * 2 + 1 < height ? r0 + stride : r0;
+        uint8_t *out = dst + (size_t)y * out_width * 4;
+        uint32_t x = 0;
+
+        if (width == 1) {
+            for (int c = 0; c < 4; c++)
+                out[c] = (r0[c] + r1[c] + 1) / 2;
+            continue;
+        }
+
+        if (gamma) {
+            for (; x < out_width; x++) {
+                uint8_t *p = r0 + x * 8, *q = r1 + x * 8;
+                for (int c = 0; c < 3; c++) {
+                    uint32_t sum = srgb_to_linear[p[c]] +
+                                   srgb_to_linear[p[c + 4]] +
+                                   srgb_to_linear[q[c]] +
+                                   srgb_to_linear[q[c + 4]];
+                    out[x * 4 + c] = linear_to_srgb[sum >> 6];
+                }
+                out[x * 4 + 3] = (p[3] + p[7] + q[3] + q[7] + 2) >> 2;
+            }
+            continue;
+        }
+
+#ifdef __SSE2__
+        if (kernels.isa >= ISA_SSE2) {
+            // 4 pixels in, 2 out: add the rows as 16 bit and then the
+            // neighbours
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i two = _mm_set1_epi16(2);
+            for (; x + 4 <= out_width; x += 4) {
+                __m128i sum[2];
+                for (int i = 0; i < 2; i++) {
+                    __m128i a =
+                        _mm_loadu_si128((__m128i *)(r0 + x * 8 + i * 16));
+                    __m128i b =
+                        _mm_loadu_si128((__m128i *)(r1 + x * 8 + i * 16));
+                    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                                               _mm_unpacklo_epi8(b, zero));
+                    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                                               _mm_unpackhi_epi8(b, zero));
+                    lo = _mm_add_epi16(lo, _mm_srli_si128(lo, 8));
+                    hi = _mm_add_epi16(hi, _mm_srli_si128(hi, 8));
+                    sum[i] = _mm_srli_epi16(
+                        _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), two), 2);
+                }
+                _mm_storeu_si128((__m128i *)(out + x * 4),
+                                 _mm_packus_epi16(sum[0], sum[1]));
+            }
+        }
+#endif
+        for (; x < out_width; x++)
+            for (int c = 0; c < 4; c++)
+                out[x * 4 + c] = (r0[x * 8 + c] + r0[x * 8 + 4 + c] +
+                                  r1[x * 8 + c] + r1[x * 8 + 4 + c] + 2) >> 2;
+    }
+}
+
+typedef struct {
+    uint8_t *src;
+    uint32_t width;
+    uint32_t height;
+    uint8_t *dst;
+    bool gamma;
+} Downsample;
+
+void downsample_job(void *arg, uint32_t first, uint32_t last) {
+    Downsample *d = arg;
+    downsample_rows(d->src, d->width, d->height, d->dst, first, last,
+                    d->gamma);
+}
+
+// halves an RGBA8 image into dst, which has to hold max(1, width / 2) *
+// max(1, height / 2) pixels
+void downsample(uint8_t *src, uint32_t width, uint32_t height, uint8_t *dst,
+                bool gamma) {
+    if (gamma)
+        pthread_once(&gamma_once, init_gamma);
+
+    Downsample d = {src, width, height, dst, gamma};
+    uint32_t out_height = height > 1 ? height / 2 : 1;
+    parallel_for(out_height, 64, downsample_job, &d);
+}
+
+/*
+ * Texture compression
+ *
+ * BC1 (DXT1) for opaque images and BC3 (DXT5) for the rest, 8:1 and 4:1 of
+ * the VRAM RGBA takes. raylib has no BC7, so that's as good as it gets. it's
+ * the bounding box method from "Real-Time DXT Compression" (van Waveren):
+ * the endpoints are the min and max of the block pulled in by 1/16 of the
+ * range, which SSE2 finds for all four channels at once, then every pixel gets
+ * projected onto the line between them. quality is a bit below a proper cluster fit but
+ * it runs at memory speed.
+ */
+
+#define BC_BLOCK_BC1 8
+#define BC_BLOCK_BC3 16
+
+typedef struct {
+    uint8_t *pixels; // RGBA8
+    uint32_t width;
+    uint32_t height;
+    uint8_t *blocks;
+    bool alpha; // BC3 instead of BC1
+} Compress;
+
+uint16_t rgb565(int r, int g, int b) {
+    return (r >> 3) << 11 | (g >> 2) << 5 | b >> 3;
+}
+
+// 565 back to 888 the way the GPU does it
+void rgb888(uint16_t c, int *rgb) {
+    rgb[0] = (c >> 11 & 31) << 3 | (c >> 13 & 7);
+    rgb[1] = (c >> 5 & 63) << 2 | (c >> 9 & 3);
+    rgb[2] = (c & 31) << 3 | (c >> 2 & 7);
+}
+
+// min and max of every channel in a 4x4 block
+void block_bounds(uint8_t block[64], uint8_t min[4], uint8_t max[4]) {
+#ifdef __SSE2__
+    if (kernels.isa >= ISA_SSE2) {
+        __m128i lo = _mm_loadu_si128((__m128i *)block);
+        __m128i hi = lo;
+        for (int i = 1; i < 4; i++) {
+            __m128i v = _mm_loadu_si128((__m128i *)(block + i * 16));
+            lo = _mm_min_epu8(lo, v);
+            hi = _mm_max_epu8(hi, v);
+        }
+        // fold 4 pixels into 1
+        lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 8));
+        hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 8));
+        lo = _mm_min_epu8(lo, _mm_srli_si128(lo, 4));
+        hi = _mm_max_epu8(hi, _mm_srli_si128(hi, 4));
+        uint32_t l = _mm_cvtsi128_si32(lo), h = _mm_cvtsi128_si32(hi);
+        memcpy(min, &l, 4);
+        memcpy(max, &h, 4);
+        return;
+    }
+#endif
+    memcpy(min, block, 4);
+    memcpy(max, block, 4);
+    for (int i = 1; i < 16; i++) {
+        for (int c = 0; c < 4; c++) {
+            uint8_t v = block[i * 4 + c];
+            min[c] = v < min[c] ? v : min[c];
+            max[c] = v > max[c] ? v : max[c];
+        }
+    }
+}
+
+void compress_color(uint8_t block[64], uint8_t min[4], uint8_t max[4],
+                    uint8_t *out) {
+    int lo[3], hi[3];
+    for (int c = 0; c < 3; c++) {
+        int inset = (max[c] - min[c]) >> 4;
+        lo[c] = min[c] + inset;
+        hi[c] = max[c] - inset;
+    }
+
+    uint16_t c0 = rgb565(hi[0], hi[1], hi[2]);
+    uint16_t c1 = rgb565(lo[0], lo[1], lo[2]);
+    uint32_t indices = 0;
+
+    // hi >= lo in every channel so c0 >= c1, and c0 > c1 is the four color
+    // mode. equal ones are a flat block, index 0 everywhere
+    if (c0 != c1) {
+        int e0[3], e1[3], axis[3];
+        rgb888(c0, e0);
+        rgb888(c1, e1);
+        int len = 0;
+        for (int c = 0; c < 3; c++) {
+            axis[c] = e0[c] - e1[c];
+            len += axis[c] * axis[c];
+        }
+
+        // how far along from c1 to c0, in thirds. 0 is c1, 3 is c0
+        static const uint8_t order[4] = {1, 3, 2, 0};
+        for (int i = 0; i < 16; i++) {
+            uint8_t *p = block + i * 4;
+            int dot = 0;
+            for (int c = 0; c < 3; c++)
+                dot += (p[c] - e1[c]) * axis[c];
+            int t = len > 0 ? (dot * 3 * 2 + len) / (len * 2) : 0;
+            t = t < 0 ? 0 : t > 3 ? 3 : t;
+            indices |= (uint32_t)order[t] << (i * 2);
+        }
+    }
+
+    out[0] = c0, out[1] = c0 >> 8;
+    out[2] = c1, out[3] = c1 >> 8;
+    memcpy(out + 4, &indices, 4); // little endian
+}
+
+void compress_alpha(uint8_t block[64], uint8_t min, uint8_t max,
+                    uint8_t *out) {
+    uint64_t indices = 0;
+    if (max != min) {
+        // 0 is max, 1 is min, 2..7 are in between from max down
+        int range = max - min;
+        for (int i = 0; i < 16; i++) {
+            int q = ((block[i * 4 + 3] - min) * 7 * 2 + range) / (range * 2);
+            int index = q == 7 ? 0 : q == 0 ? 1 : 8 - q;
+            indices |= (uint64_t)index << (i * 3);
+        }
+    }
+
+    out[0] = max;
+    out[1] = min;
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = indices >> (i * 8);
+}
+
+// block rows [first, last), blocks past the image edge repeat its pixels
+void compress_job(void *arg, uint32_t first, uint32_t last) {
+    Compress *c = arg;
+    uint32_t blocks_wide = (c->width + 3) / 4;
+    size_t block_size = c->alpha ? BC_BLOCK_BC3 : BC_BLOCK_BC1;
+    uint8_t block[64];
+
+    for (uint32_t by = first; by < last; by++) {
+        uint8_t *out = c->blocks + by * blocks_wide * block_size;
+        for (uint32_t bx = 0; bx < blocks_wide; bx++) {
+            for (uint32_t y = 0; y < 4; y++) {
+                uint32_t sy = by * 4 + y < c->height ? by * 4 + y
+                                                     : c->height - 1;
+                uint8_t *row = c->pixels + (size_t)sy * c->width * 4;
+                for (uint32_t x = 0; x < 4; x++) {
+                    uint32_t sx = bx * 4 + x < c->width ? bx * 4 + x
+                                                        : c->width - 1;
+                    memcpy(block + (y * 4 + x) * 4, row + sx * 4, 4);
+                }
+            }
+
+            uint8_t min[4], max[4];
+            block_bounds(block, min, max);
+            if (c->alpha) {
+                compress_alpha(block, min[3], max[3], out);
+                out += 8;
+            }
+            compress_color(block, min, max, out);
+            out += 8;
+        }
+    }
+}
+
+size_t compressed_size(uint32_t width, uint32_t height, bool alpha) {
+    return (size_t)((width + 3) / 4) * ((height + 3) / 4) *
+           (alpha ? BC_BLOCK_BC3 : BC_BLOCK_BC1);
+}
+
+// compresses an RGBA8 image into blocks, which needs compressed_size()
+void compress_image(uint8_t *pixels, uint32_t width, uint32_t height,
+                    bool alpha, uint8_t *blocks) {
+    Compress c = {pixels, width, height, blocks, alpha};
+    parallel_for((height + 3) / 4, 16, compress_job, &c);
+}
+
+/*
+ * the compressed levels of an image go into the disk cache too, keyed by a
+ * hash of its pixels since they don't have to come from a file.
+ */
+
+#define BC_MAGIC "PODBC001"
+
+typedef struct {
+    char magic[8];
+    uint64_t hash; // of the RGBA8 pixels
+    uint32_t width;
+    uint32_t height;
+    uint32_t format; // PIXELFORMAT_COMPRESSED_DXT1_RGB or DXT5_RGBA
+    uint32_t gamma;  // levels averaged in linear light
+    uint64_t size;   // of all levels
+} BcHeader;
+
+// not cryptographic, four lanes so the multiplies don't wait on each other
+uint64_t hash_pixels(uint8_t *data, size_t size) {
+    uint64_t lanes[4] = {size, ~size, size << 32, 0x9e3779b97f4a7c15ull};
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        for (int k = 0; k < 4; k++) {
+            uint64_t v;
+            memcpy(&v, data + i + k * 8, 8);
+            lanes[k] = (lanes[k] ^ v) * 0x9e3779b97f4a7c15ull;
+            lanes[k] ^= lanes[k] >> 32;
+        }
+    }
+
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (int k = 0; k < 4; k++)
+        hash = (hash ^ lanes[k]) * 0x100000001b3ull;
+    for (; i < size; i++)
+        hash = (hash ^ data[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+void bc_key(DiskCache *cache, BcHeader *key, char *path, size_t len) {
+    // FNV-1a of the whole key
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < sizeof(*key); i++)
+        hash = (hash ^ ((uint8_t *)key)[i]) * 0x100000001b3ull;
+
+    snprintf(path, len, "%s/%016llx.bc", cache->dir, (unsigned long long)hash);
+}
+
+// the mapped blocks or NULL, free them with free_image()
+uint8_t *bc_cache_load(DiskCache *cache, BcHeader *key) {
+    char path[4096];
+    bc_key(cache, key, path, sizeof(path));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+
+    BcHeader header;
+    struct stat st;
+    uint8_t *blocks = NULL;
+    if (pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        memcmp(&header, key, sizeof(header)) == 0 && fstat(fd, &st) == 0 &&
+        (uint64_t)st.st_size == RAW_HEADER + key->size) {
+        blocks = disk_cache_map(fd, RAW_HEADER + key->size);
+        futimens(fd, NULL);
+    }
+    close(fd);
+    return blocks;
+}
+
+void bc_cache_store(DiskCache *cache, BcHeader *key, uint8_t *blocks) {
+    char path[4096];
+    bc_key(cache, key, path, sizeof(path));
+    disk_cache_write(cache, path, key, sizeof(*key), blocks, key->size);
+}
+
+/*
+ * Tiles
+ *
+ * the image is uploaded in TILE_SIZE squares and only the ones that come into
+ * view. 1024 is the smallest max texture size GL 3.3 allows, so every driver
+ * takes them no matter how big the image is. tiles that haven't been drawn for
+ * the longest get unloaded once more than TILE_BUDGET bytes are on the GPU.
+ *
+ * zoomed out the tiles come from a mip level instead, so about a screen worth
+ * of texels gets drawn at any zoom. levels stop once one tile holds the whole
+ * thing, each tile has its own mip chain for the zoom in between.
+ *
+ * while the image is still being decoded (partial) new rows are pushed down
+ * the levels and into loaded tiles with UpdateTextureRec(). the tiles go
+ * without mips until then, UpdateTextureRec() only updates the first one.
+ *
+ * with --bc the levels are compressed once the image stops changing and the
+ * tiles are cut from the blocks. those tiles have no mips of their own, the
+ * levels still cover zooming out, and their textures are padded to whole
+ * blocks since raylib gets the size of anything else wrong.
+ */
+
+#define TILE_SIZE 1024
+#define TILE_BUDGET ((size_t)512 << 20)
+#define TILE_UPLOADS 4 // per frame, so scrolling doesn't stall
+#define MAX_LEVELS 16
+
+typedef struct {
+    Texture2D texture;
+    bool loaded;
+    bool dirty;         // image changed after the upload
+    size_t bytes;       // with mips
+    uint64_t last_used; // frame it was last drawn in
+} Tile;
+
+typedef struct {
+    Image image; // RGBA8, the tiles are cut from this
+    uint32_t cols;
+    uint32_t rows;
+    Tile *tiles;
+    uint32_t ready;  // rows that are up to date
+    uint8_t *blocks; // the image compressed, tiles come from here if set
+} TileLevel;
+
+typedef struct {
+    TileLevel levels[MAX_LEVELS]; // 0 is the image itself
+    uint32_t level_count;
+    bool gamma;
+    bool partial;     // image is still being decoded
+    uint8_t *scratch; // pixels of one tile and its mips
+    size_t vram;      // bytes of loaded tiles
+    uint64_t frame;
+    int format;      // of the tiles, DXT1/DXT5 once compressed
+    uint8_t *blocks; // of all levels, mapped from the disk cache or not
+} TiledImage;
+
+// levels below 0 from the image
+void build_levels(TiledImage *t) {
+    for (uint32_t i = 1; i < t->level_count; i++) {
+        Image *up = &t->levels[i - 1].image;
+        downsample(up->data, up->width, up->height, t->levels[i].image.data,
+                   t->gamma);
+    }
+}
+
+// partial images get their levels filled in by tiles_progress()
+void tiles_init(TiledImage *t, Image image, bool gamma, bool partial) {
+    *t = (TiledImage){
+        .gamma = gamma,
+        .partial = partial,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+    if (gamma)
+        pthread_once(&gamma_once, init_gamma);
+
+    uint32_t width = image.width, height = image.height;
+    for (uint32_t i = 0; i < MAX_LEVELS; i++) {
+        TileLevel *level = &t->levels[t->level_count++];
+        level->image = image;
+        if (i > 0) {
+            level->image.width = width;
+            level->image.height = height;
+            level->image.data = calloc((size_t)width * height, 4);
+        }
+        level->ready = partial ? 0 : height;
+        level->cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+        level->rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+        level->tiles = calloc((size_t)level->cols * level->rows, sizeof(Tile));
+
+        if (width <= TILE_SIZE && height <= TILE_SIZE)
+            break;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+    if (!partial)
+        build_levels(t);
+
+    // a full chain is at most a third on top
+    t->scratch = malloc((size_t)TILE_SIZE * TILE_SIZE * 4 * 4 / 3 + 64);
+}
+
+void tile_unload(TiledImage *t, Tile *tile) {
+    UnloadTexture(tile->texture);
+    t->vram -= tile->bytes;
+    tile->loaded = false;
+}
+
+void tiles_mark_dirty(TiledImage *t) {
+    for (uint32_t l = 0; l < t->level_count; l++) {
+        TileLevel *level = &t->levels[l];
+        for (uint32_t i = 0; i < level->cols * level->rows; i++)
+            level->tiles[i].dirty = true;
+    }
+}
+
+// the image changed, tiles have to be uploaded again
+void tiles_invalidate(TiledImage *t) {
+    build_levels(t);
+    tiles_mark_dirty(t);
+}
+
+void tiles_free(TiledImage *t) {
+    for (uint32_t l = 0; l < t->level_count; l++) {
+        TileLevel *level = &t->levels[l];
+        for (uint32_t i = 0; i < level->cols * level->rows; i++)
+            if (level->tiles[i].loaded)
+                tile_unload(t, &level->tiles[i]);
+        free(level->tiles);
+        if (l > 0)
+            free(level->image.data);
+    }
+    if (t->blocks)
+        free_image((Image){.data = t->blocks});
+    free(t->scratch);
+}
+
+// compresses every level, or maps them from the cache if it has them. only
+// for images that don't change anymore, compressed tiles can't be updated
+void tiles_compress(TiledImage *t, DiskCache *cache) {
+    Image *image = &t->levels[0].image;
+    size_t count = (size_t)image->width * image->height;
+    bool alpha = qoi_channels(image->data, count) == 4;
+
+    BcHeader key = {
+        .magic = BC_MAGIC,
+        .hash = hash_pixels(image->data, count * 4),
+        .width = image->width,
+        .height = image->height,
+        .format = alpha ? PIXELFORMAT_COMPRESSED_DXT5_RGBA
+                        : PIXELFORMAT_COMPRESSED_DXT1_RGB,
+        .gamma = t->gamma,
+    };
+    for (uint32_t l = 0; l < t->level_count; l++) {
+        Image *level = &t->levels[l].image;
+        key.size += compressed_size(level->width, level->height, alpha);
+    }
+
+    t->blocks = cache ? bc_cache_load(cache, &key) : NULL;
+    bool hit = t->blocks != NULL;
+    if (!hit)
+        t->blocks = malloc(key.size);
+
+    uint8_t *blocks = t->blocks;
+    for (uint32_t l = 0; l < t->level_count; l++) {
+        TileLevel *level = &t->levels[l];
+        level->blocks = blocks;
+        if (!hit)
+            compress_image(level->image.data, level->image.width,
+                           level->image.height, alpha, blocks);
+        blocks += compressed_size(level->image.width, level->image.height,
+                                  alpha);
+    }
+
+    if (cache && !hit)
+        bc_cache_store(cache, &key, t->blocks);
+
+    t->format = key.format;
+    tiles_mark_dirty(t);
+}
+
+// size of tile tx, ty of a level, only the last ones are smaller than a tile
+void tile_extent(TileLevel *level, uint32_t tx, uint32_t ty, uint32_t *width,
+                 uint32_t *height) {
+    uint32_t x = tx * TILE_SIZE, y = ty * TILE_SIZE;
+    *width = level->image.width - x < TILE_SIZE ? level->image.width - x
+                                                : TILE_SIZE;
+    *height = level->image.height - y < TILE_SIZE ? level->image.height - y
+                                                  : TILE_SIZE;
+}
+
+// copies the block rows of tile tx, ty into t->scratch, the image is padded
+// to whole blocks
+Image tile_blocks(TiledImage *t, TileLevel *level, uint32_t tx, uint32_t ty) {
+    uint32_t width, height;
+    tile_extent(level, tx, ty, &width, &height);
+
+    bool alpha = t->format == PIXELFORMAT_COMPRESSED_DXT5_RGBA;
+    size_t block_size = alpha ? BC_BLOCK_BC3 : BC_BLOCK_BC1;
+    size_t stride = compressed_size(level->image.width, 4, alpha);
+    size_t row = compressed_size(width, 4, alpha);
+    uint8_t *src = level->blocks + (size_t)ty * TILE_SIZE / 4 * stride +
+                   (size_t)tx * TILE_SIZE / 4 * block_size;
+    for (uint32_t j = 0; j < (height + 3) / 4; j++)
+        memcpy(t->scratch + j * row, src + j * stride, row);
+
+    return (Image){
+        .data = t->scratch,
+        .width = (width + 3) & ~3u,
+        .height = (height + 3) & ~3u,
+        .mipmaps = 1,
+        .format = t->format,
+    };
+}
+
+// copies tile tx, ty of a level into t->scratch and puts its mips after it
+Image tile_image(TiledImage *t, TileLevel *level, uint32_t tx, uint32_t ty) {
+    uint32_t x = tx * TILE_SIZE;
+    uint32_t y = ty * TILE_SIZE;
+    uint32_t width, height;
+    tile_extent(level, tx, ty, &width, &height);
+
+    size_t stride = (size_t)level->image.width * 4;
+    uint8_t *src = (uint8_t *)level->image.data + y * stride + (size_t)x * 4;
+    for (uint32_t j = 0; j < height; j++)
+        memcpy(t->scratch + (size_t)j * width * 4, src + j * stride,
+               (size_t)width * 4);
+
+    Image image = {
+        .data = t->scratch,
+        .width = width,
+        .height = height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+
+    uint8_t *mip = t->scratch;
+    while (!t->partial && (width > 1 || height > 1)) {
+        uint8_t *next = mip + (size_t)width * height * 4;
+        downsample_rows(mip, width, height, next, 0,
+                        height > 1 ? height / 2 : 1, t->gamma);
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+        mip = next;
+        image.mipmaps++;
+    }
+
+    return image;
+}
+
+void tile_load(TiledImage *t, TileLevel *level, Tile *tile, uint32_t tx,
+               uint32_t ty) {
+    Image image = level->blocks ? tile_blocks(t, level, tx, ty)
+                                : tile_image(t, level, tx, ty);
+    tile->texture = LoadTextureFromImage(image);
+    SetTextureFilter(tile->texture, image.mipmaps > 1
+                                        ? TEXTURE_FILTER_TRILINEAR
+                                        : TEXTURE_FILTER_BILINEAR);
+    tile->loaded = true;
+    tile->dirty = false;
+
+    bool alpha = image.format == PIXELFORMAT_COMPRESSED_DXT5_RGBA;
+    tile->bytes = 0;
+    for (int i = 0; i < image.mipmaps; i++) {
+        uint32_t width = image.width >> i, height = image.height >> i;
+        width = width ? width : 1;
+        height = height ? height : 1;
+        tile->bytes += level->blocks ? compressed_size(width, height, alpha)
+                                     : (size_t)width * height * 4;
+    }
+    t->vram += tile->bytes;
+}
+
+// uploads rows [first, last) of a level into the tiles that are loaded
+void tiles_update_rows(TiledImage *t, TileLevel *level, uint32_t first,
+                       uint32_t last) {
+    size_t stride = (size_t)level->image.width * 4;
+
+    for (uint32_t ty = first / TILE_SIZE; ty <= (last - 1) / TILE_SIZE; ty++) {
+        uint32_t y0 = first > ty * TILE_SIZE ? first : ty * TILE_SIZE;
+        uint32_t y1 = last < (ty + 1) * TILE_SIZE ? last : (ty + 1) * TILE_SIZE;
+
+        for (uint32_t tx = 0; tx < level->cols; tx++) {
+            Tile *tile = &level->tiles[ty * level->cols + tx];
+            if (!tile->loaded || tile->dirty)
+                continue;
+
+            uint32_t width = tile->texture.width;
+            uint8_t *src = (uint8_t *)level->image.data + y0 * stride +
+                           (size_t)tx * TILE_SIZE * 4;
+            for (uint32_t y = y0; y < y1; y++)
+                memcpy(t->scratch + (size_t)(y - y0) * width * 4,
+                       src + (y - y0) * stride, (size_t)width * 4);
+
+            Rectangle rect = {0, y0 - ty * TILE_SIZE, width, y1 - y0};
+            UpdateTextureRec(tile->texture, rect, t->scratch);
+        }
+    }
+}
+
+// rows [0, rows) of a partial image are decoded now
+void tiles_progress(TiledImage *t, uint32_t rows) {
+    uint32_t ready = rows;
+    for (uint32_t l = 0; l < t->level_count; l++) {
+        TileLevel *level = &t->levels[l];
+
+        // a row below needs both rows above it
+        if (l > 0) {
+            TileLevel *up = &t->levels[l - 1];
+            ready = ready == (uint32_t)up->image.height
+                        ? (uint32_t)level->image.height
+                        : ready / 2;
+            if (ready > level->ready)
+                downsample_rows(up->image.data, up->image.width,
+                                up->image.height, level->image.data,
+                                level->ready, ready, t->gamma);
+        }
+
+        if (ready > level->ready)
+            tiles_update_rows(t, level, level->ready, ready);
+        level->ready = ready;
+    }
+
+    // done, everything gets its mips now
+    if (rows == (uint32_t)t->levels[0].image.height) {
+        t->partial = false;
+        tiles_mark_dirty(t);
+    }
+}
+
+// draws the tiles the camera sees, has to be called in BeginMode2D(). returns
+// false if some were left for the next frames
+bool tiles_draw(TiledImage *t, Camera2D camera) {
+    // the smallest level that still has a texel per pixel
+    uint32_t l = 0;
+    while (l + 1 < t->level_count && camera.zoom * (2 << l) <= 1)
+        l++;
+    TileLevel *level = &t->levels[l];
+    float scale = 1 << l;
+    float size = TILE_SIZE * scale;
+
+    Vector2 min = GetScreenToWorld2D((Vector2){0, 0}, camera);
+    Vector2 max = GetScreenToWorld2D(
+        (Vector2){GetScreenWidth(), GetScreenHeight()}, camera);
+
+    // tiles [x0, x1) and [y0, y1) are on screen, clamped in float so
+    // nothing out of range gets converted
+    uint32_t x0 = fminf(fmaxf(floorf(min.x / size), 0), level->cols);
+    uint32_t y0 = fminf(fmaxf(floorf(min.y / size), 0), level->rows);
+    uint32_t x1 = fminf(fmaxf(floorf(max.x / size) + 1, 0), level->cols);
+    uint32_t y1 = fminf(fmaxf(floorf(max.y / size) + 1, 0), level->rows);
+
+    uint32_t uploads = 0;
+    for (uint32_t ty = y0; ty < y1; ty++) {
+        for (uint32_t tx = x0; tx < x1; tx++) {
+            Tile *tile = &level->tiles[ty * level->cols + tx];
+
+            if (tile->loaded && tile->dirty)
+                tile_unload(t, tile);
+            if (!tile->loaded) {
+                if (uploads++ >= TILE_UPLOADS)
+                    continue;
+                tile_load(t, level, tile, tx, ty);
+            }
+
+            // without the padding of compressed ones
+            uint32_t width, height;
+            tile_extent(level, tx, ty, &width, &height);
+            tile->last_used = t->frame;
+            DrawTexturePro(tile->texture, (Rectangle){0, 0, width, height},
+                           (Rectangle){tx * size, ty * size, width * scale,
+                                       height * scale},
+                           (Vector2){0, 0}, 0, WHITE);
+        }
+    }
+
+    // least recently drawn first, never what is on screen right now
+    while (t->vram > TILE_BUDGET) {
+        Tile *oldest = NULL;
+        for (uint32_t j = 0; j < t->level_count; j++) {
+            TileLevel *level = &t->levels[j];
+            for (uint32_t i = 0; i < level->cols * level->rows; i++) {
+                Tile *tile = &level->tiles[i];
+                if (tile->loaded && tile->last_used != t->frame &&
+                    (!oldest || tile->last_used < oldest->last_used))
+                    oldest = tile;
+            }
+        }
+        if (!oldest)
+            break;
+        tile_unload(t, oldest);
+    }
+
+    t->frame++;
+    return uploads <= TILE_UPLOADS;
+}
+
+/*
+ * Progressive decode
+ *
+ * the viewer opens on an empty image right away while a thread decodes into
+ * it and publishes how many rows are done, render() uploads them as they come
+ */
+
+typedef struct {
+    PNG *png;
+    const char *pngfile;
+    DiskCache *cache; // gets the image once it's complete, can be NULL
+    bool raw_color;   // DecodeOptions.raw_color
+    Image image;
+    atomic_uint rows;
+    atomic_bool cancel;
+    pthread_t thread;
+} Decoder;
+
+void *decoder_worker(void *p) {
+    Decoder *d = p;
+    char err[256];
+    DecodeOptions opts = {
+        .pixels = d->image.data,
+        .progress = &d->rows,
+        .cancel = &d->cancel,
+        .raw_color = d->raw_color,
+        .err = err,
+        .errlen = sizeof(err),
+    };
+
+    // the rows that made it stay up, the broken rest stays transparent
+    if (!decode_png(d->png, &opts).data) {
+        printf("%s: %s\n", d->pngfile, err);
+        return NULL;
+    }
+
+    if (d->cache && !atomic_load(&d->cancel))
+        disk_cache_store(d->cache, d->pngfile, d->image);
+    return NULL;
+}
+
+// the returned image fills in while the decoder runs
+Image decoder_start(Decoder *d, PNG *png, const char *pngfile,
+                    DiskCache *cache, bool raw_color) {
+    d->png = png;
+    d->pngfile = pngfile;
+    d->cache = cache;
+    d->raw_color = raw_color;
+    d->image = (Image){
+        .data = calloc((size_t)png->width * png->height, 4),
+        .width = png->width,
+        .height = png->height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+    atomic_init(&d->rows, 0);
+    atomic_init(&d->cancel, false);
+
+    if (png->interlace)
+        panic("Poder does not support interlaced PNGs");
+    if (pthread_create(&d->thread, NULL, decoder_worker, d) != 0)
+        panic("Couldn't start the decoder thread");
+
+    return d->image;
+}
+
+void decoder_stop(Decoder *d) {
+    atomic_store(&d->cancel, true);
+    pthread_join(d->thread, NULL);
+}
+
+/*
+ * Browsing
+ *
+ * a list of files that left/right step through. workers decode the files
+ * around the current one ahead of time into an LRU cache, so stepping to them
+ * is just a texture upload. decoded pixels plus the tiles on the GPU are kept
+ * under BROWSE_BUDGET, files that are further away get evicted first and
+ * nothing new is prefetched while over it.
+ */
+
+#define BROWSE_BUDGET ((size_t)1 << 30)
+#define PREFETCH_AHEAD 3
+#define PREFETCH_BEHIND 1
+#define PREFETCH_WORKERS 4
+
+typedef struct {
+    Image image;
+    bool ready;
+    bool decoding;
+    bool failed;
+    uint64_t last_used;
+} CacheEntry;
+
+typedef struct {
+    char **files;
+    uint32_t count;
+    CacheEntry *entries; // one per file
+    DiskCache *cache;    // decoded files are looked up and stored here
+    bool raw_color;      // DecodeOptions.raw_color
+
+    uint32_t current; // wanted on screen
+    uint32_t shown;   // on screen, never evicted
+    size_t used;      // decoded bytes in the cache
+    size_t gpu;       // tile bytes, render() keeps this up to date
+    uint64_t clock;
+    bool quit;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t workers[PREFETCH_WORKERS];
+    uint32_t worker_count;
+} Browser;
+
+// i-th file to prefetch, current first and then alternating around it
+uint32_t prefetch_order(Browser *b, uint32_t i) {
+    static const int offsets[] = {0, 1, -1, 2, 3};
+    _Static_assert(sizeof(offsets) / sizeof(offsets[0]) ==
+                       1 + PREFETCH_AHEAD + PREFETCH_BEHIND,
+                   "prefetch offsets");
+    return (b->current + b->count + offsets[i]) % b->count;
+}
+
+bool in_prefetch_window(Browser *b, uint32_t file) {
+    for (uint32_t i = 0; i < 1 + PREFETCH_AHEAD + PREFETCH_BEHIND; i++)
+        if (prefetch_order(b, i) == file)
+            return true;
+    return false;
+}
+
+// evicts the least recently used files outside the window, lock is held
+void browser_evict(Browser *b) {
+    while (b->used + b->gpu > BROWSE_BUDGET) {
+        CacheEntry *oldest = NULL;
+        for (uint32_t i = 0; i < b->count; i++) {
+            CacheEntry *e = &b->entries[i];
+            if (e->ready && i != b->shown && !in_prefetch_window(b, i) &&
+                (!oldest || e->last_used < oldest->last_used))
+                oldest = e;
+        }
+        if (!oldest)
+            return;
+
+        b->used -= (size_t)oldest->image.width * oldest->image.height * 4;
+        free_image(oldest->image);
+        oldest->ready = false;
+    }
+}
+
+// verify_png() says where a file broke, which beats what the decoder knows
+void explain_failure(const char *pngfile, char *err, size_t errlen) {
+    char where[256];
+    if (!verify_png(pngfile, where, sizeof(where)))
+        snprintf(err, errlen, "%s", where);
+}
+
+// decodes a whole png or qoi file, false with a message in err for broken
+// ones. qoi is about as fast as the disk cache already, it skips that. the
+// cache only has color managed pixels, pass none with raw_color
+bool load_image(const char *pngfile, Image *image, DiskCache *cache,
+                bool raw_color, char *err, size_t errlen) {
+    if (is_qoi(pngfile)) {
+        if (read_qoi(pngfile, image))
+            return true;
+        snprintf(err, errlen, "broken QOI file");
+        return false;
+    }
+
+    if (cache && disk_cache_load(cache, pngfile, image))
+        return true;
+
+    PNG png = {0};
+    if (!load_png(pngfile, &png, err, errlen)) {
+        explain_failure(pngfile, err, errlen);
+        return false;
+    }
+
+    DecodeOptions opts = {.raw_color = raw_color, .err = err, .errlen = errlen};
+    *image = decode_png(&png, &opts);
+    if (!image->data) {
+        explain_failure(pngfile, err, errlen);
+        free_png(&png);
+        return false;
+    }
+
+    // animations only have their default image here, they stay uncached
+    if (cache && png.frame_count < 2)
+        disk_cache_store(cache, pngfile, *image);
+    free_png(&png);
+    return true;
+}
+
+void *browser_worker(void *p) {
+    Browser *b = p;
+
+    pthread_mutex_lock(&b->lock);
+    while (true) {
+        // nearest file that still needs decoding, unless over budget
+        uint32_t file = b->count;
+        for (uint32_t i = 0; i < 1 + PREFETCH_AHEAD + PREFETCH_BEHIND; i++) {
+            uint32_t f = prefetch_order(b, i);
+            CacheEntry *e = &b->entries[f];
+            if (e->ready || e->decoding || e->failed)
+                continue;
+            if (f == b->current || b->used + b->gpu < BROWSE_BUDGET)
+                file = f;
+            break;
+        }
+
+        if (b->quit)
+            break;
+        if (file == b->count) {
+            pthread_cond_wait(&b->cond, &b->lock);
+            continue;
+        }
+
+        CacheEntry *e = &b->entries[file];
+        e->decoding = true;
+        pthread_mutex_unlock(&b->lock);
+
+        Image image;
+        char err[256];
+        bool ok = load_image(b->files[file], &image, b->cache, b->raw_color,
+                             err, sizeof(err));
+        if (!ok)
+            printf("%s: %s\n", b->files[file], err);
+
+        pthread_mutex_lock(&b->lock);
+        e->decoding = false;
+        e->failed = !ok;
+        if (ok) {
+            e->image = image;
+            e->ready = true;
+            e->last_used = ++b->clock;
+            b->used += (size_t)image.width * image.height * 4;
+            browser_evict(b);
+        }
+        pthread_cond_broadcast(&b->cond);
+    }
+    pthread_mutex_unlock(&b->lock);
+    return NULL;
+}
+
+Browser *browser_start(char **files, uint32_t count, DiskCache *cache,
+                       bool raw_color) {
+    Browser *b = calloc(1, sizeof(Browser));
+    b->files = files;
+    b->count = count;
+    b->cache = cache;
+    b->raw_color = raw_color;
+    b->entries = calloc(count, sizeof(CacheEntry));
+    b->shown = count; // nothing yet
+    pthread_mutex_init(&b->lock, NULL);
+    pthread_cond_init(&b->cond, NULL);
+
+    uint32_t workers = cpu_count();
+    workers = workers < PREFETCH_WORKERS ? workers : PREFETCH_WORKERS;
+    for (uint32_t i = 0; i < workers; i++)
+        if (pthread_create(&b->workers[b->worker_count], NULL, browser_worker,
+                           b) == 0)
+            b->worker_count++;
+    if (b->worker_count == 0)
+        panic("Couldn't start any prefetch threads");
+
+    return b;
+}
+
+bool has_extension(const char *path, const char *ext) {
+    size_t len = strlen(path), ext_len = strlen(ext);
+    return len >= ext_len && strcasecmp(path + len - ext_len, ext) == 0;
+}
+
+int compare_paths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// files as they are and the .png and .qoi files in directories, sorted by
+// name
+char **list_images(char **paths, uint32_t path_count, uint32_t *count) {
+    uint32_t cap = 64;
+    char **files = malloc(cap * sizeof(char *));
+    *count = 0;
+
+    for (uint32_t i = 0; i < path_count; i++) {
+        DIR *dir = opendir(paths[i]);
+        if (dir == NULL) {
+            if (*count == cap)
+                files = realloc(files, (cap *= 2) * sizeof(char *));
+            files[(*count)++] = strdup(paths[i]);
+            continue;
+        }
+
+        uint32_t first = *count;
+        struct dirent *entry;
+        while ((entry = readdir(dir)) != NULL) {
+            size_t len = strlen(entry->d_name);
+            if (!has_extension(entry->d_name, ".png") &&
+                !has_extension(entry->d_name, ".qoi"))
+                continue;
+
+            if (*count == cap)
+                files = realloc(files, (cap *= 2) * sizeof(char *));
+            size_t size = strlen(paths[i]) + len + 2;
+            files[*count] = malloc(size);
+            snprintf(files[(*count)++], size, "%s/%s", paths[i], entry->d_name);
+        }
+        closedir(dir);
+        qsort(files + first, *count - first, sizeof(char *), compare_paths);
+    }
+    return files;
+}
+
+// moves the wanted file by step, wrapping around
+void browser_step(Browser *b, int step) {
+    pthread_mutex_lock(&b->lock);
+    b->current = (b->current + b->count + step % (int)b->count) % b->count;
+    b->entries[b->current].last_used = ++b->clock;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+}
+
+// the wanted file if it's decoded and not on screen yet, it's shown from
+// here on. false while it's still coming
+bool browser_take(Browser *b, Image *image, uint32_t *file) {
+    pthread_mutex_lock(&b->lock);
+    CacheEntry *e = &b->entries[b->current];
+    bool ready = b->current != b->shown && e->ready;
+    if (ready) {
+        *image = e->image;
+        *file = b->shown = b->current;
+        e->last_used = ++b->clock;
+    }
+    pthread_mutex_unlock(&b->lock);
+    return ready;
+}
+
+// true while render() should keep checking for the wanted file
+bool browser_waiting(Browser *b) {
+    pthread_mutex_lock(&b->lock);
+    bool waiting = b->current != b->shown && !b->entries[b->current].failed;
+    pthread_mutex_unlock(&b->lock);
+    return waiting;
+}
+
+void browser_set_gpu(Browser *b, size_t gpu) {
+    pthread_mutex_lock(&b->lock);
+    if (gpu != b->gpu) {
+        b->gpu = gpu;
+        browser_evict(b);
+        pthread_cond_broadcast(&b->cond);
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+void browser_stop(Browser *b) {
+    pthread_mutex_lock(&b->lock);
+    b->quit = true;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+    for (uint32_t i = 0; i < b->worker_count; i++)
+        pthread_join(b->workers[i], NULL);
+
+    for (uint32_t i = 0; i < b->count; i++)
+        if (b->entries[i].ready)
+            free_image(b->entries[i].image);
+    free(b->entries);
+    pthread_mutex_destroy(&b->lock);
+    pthread_cond_destroy(&b->cond);
+    free(b);
+}
+
+/*
+ * Transcode
+ *
+ * png files become qoi and qoi files png, next to the original with the
+ * extension swapped. opaque images get written without alpha, and a file that
+ * is already there is left alone
+ */
+
+typedef struct {
+    char **files;
+    EncodeOptions *encode;
+    bool *failed;
+    char (*results)[4400];
+} Transcode;
+
+// RGBA8 image to a png, rgb if nothing is transparent
+bool write_image_png(const char *path, Image image, EncodeOptions *opts) {
+    size_t count = (size_t)image.width * image.height;
+    if (qoi_channels(image.data, count) == 4)
+        return poder_encode(path, image.data, image.width, image.height,
+                            COLOR_TRUEALPHA_RGBA, opts);
+
+    uint8_t *rgb = malloc(count * 3);
+    uint8_t *rgba = image.data;
+    for (size_t i = 0; i < count; i++)
+        memcpy(rgb + i * 3, rgba + i * 4, 3);
+    bool ok = poder_encode(path, rgb, image.width, image.height,
+                           COLOR_TRUE_RGB, opts);
+    free(rgb);
+    return ok;
+}
+
+// just the pixel bytes, in whatever layout they were decoded to
+bool write_raw(const char *path, Image image) {
+    FILE *file = fopen(path, "wb");
+    if (!file)
+        return false;
+    size_t bpp = image.format == PIXELFORMAT_UNCOMPRESSED_R16G16B16A16 ? 8 : 4;
+    size_t size = (size_t)image.width * image.height * bpp;
+    bool ok = fwrite(image.data, 1, size, file) == size;
+    return fclose(file) == 0 && ok;
+}
+
+// png, qoi or raw by the extension of path
+bool write_image(const char *path, Image image, EncodeOptions *opts) {
+    if (has_extension(path, ".raw"))
+        return write_raw(path, image);
+    if (has_extension(path, ".qoi"))
+        return write_qoi(path, image);
+    return write_image_png(path, image, opts);
+}
+
+void transcode_file(Transcode *t, uint32_t i) {
+    const char *in = t->files[i];
+    bool to_png = is_qoi(in);
+
+    // swap the extension, or add one if there is none
+    char out[4096];
+    const char *slash = strrchr(in, '/');
+    const char *dot = strrchr(slash ? slash : in, '.');
+    int stem = dot ? dot - in : (int)strlen(in);
+    snprintf(out, sizeof(out), "%.*s%s", stem, in, to_png ? ".png" : ".qoi");
+
+    // never replace a file, it's likely the original of a round trip. the
+    // empty one made here is only kept once the image is written into it
+    int fd = open(out, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        snprintf(t->results[i], sizeof(t->results[i]), "%s %s", out,
+                 errno == EEXIST ? "exists, skipped" : strerror(errno));
+        t->failed[i] = true;
+        return;
+    }
+    close(fd);
+
+    Image image;
+    char err[256];
+    if (!load_image(in, &image, NULL, false, err, sizeof(err))) {
+        snprintf(t->results[i], sizeof(t->results[i]), "%s", err);
+        t->failed[i] = true;
+        unlink(out);
+        return;
+    }
+
+    bool ok = to_png ? write_image_png(out, image, t->encode)
+                     : write_qoi(out, image);
+    free_image(image);
+    if (!ok)
+        unlink(out);
+
+    struct stat st;
+    if (ok && stat(out, &st) == 0) {
+        snprintf(t->results[i], sizeof(t->results[i]), "-> %s (%lld bytes)",
+                 out, (long long)st.st_size);
+    } else {
+        snprintf(t->results[i], sizeof(t->results[i]), "couldn't write %s",
+                 out);
+        t->failed[i] = true;
+    }
+}
+
+void transcode_job(void *arg, uint32_t first, uint32_t last) {
+    for (uint32_t i = first; i < last; i++)
+        transcode_file(arg, i);
+}
+
+uint32_t transcode_files(char **files, uint32_t count, EncodeOptions *encode) {
+    Transcode t = {
+        .files = files,
+        .encode = encode,
+        .failed = calloc(count, sizeof(bool)),
+        .results = calloc(count, sizeof(*t.results)),
+    };
+
+    // a single file lets the png encoder have the cores
+    if (count == 1)
+        transcode_file(&t, 0);
+    else
+        parallel_for(count, 1, transcode_job, &t);
+
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        printf("%s: %s\n", files[i], t.results[i]);
+        failed += t.failed[i];
+    }
+
+    free(t.failed);
+    free(t.results);
+    return failed;
+}
+
+/*
+ * Atlas
+ *
+ * packs many images into one. only the IHDRs are read to place them with a
+ * skyline packer, then every png is decoded in parallel straight into its
+ * rectangle of the atlas, rows going out with the atlas stride, so no image
+ * ever exists on its own. qoi files have to be decoded and copied in. a json
+ * file next to the atlas says where everything went.
+ */
+
+#define ATLAS_MAX_WIDTH 16384
+#define ATLAS_PADDING 1 // between images, so filtering doesn't bleed
+
+typedef struct {
+    char *file;
+    uint32_t width;
+    uint32_t height;
+    uint32_t x;
+    uint32_t y;
+} Sprite;
+
+// the top of the images placed so far, from left to right
+typedef struct {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+} Skyline;
+
+typedef struct {
+    Sprite *sprites;
+    uint8_t *pixels;
+    uint32_t width; // of the atlas
+    bool *failed;
+    char (*results)[256]; // why a sprite failed
+} Atlas;
+
+// just the size from the header, false if it isn't a png or qoi
+bool probe_image(const char *path, uint32_t *width, uint32_t *height,
+                 char *err, size_t errlen) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        snprintf(err, errlen, "can't open it");
+        return false;
+    }
+
+    // signature, IHDR length and type, width, height, depth, color type,
+    // compression, filter, interlace
+    uint8_t head[29];
+    size_t n = fread(head, 1, sizeof(head), file);
+    fclose(file);
+
+    if (n >= 12 && memcmp(head, "qoif", 4) == 0) {
+        *width = convert_uint(head + 4);
+        *height = convert_uint(head + 8);
+    } else if (n == sizeof(head) &&
+               memcmp(head, "\x89PNG\r\n\x1a\n", 8) == 0 &&
+               memcmp(head + 12, "IHDR", 4) == 0) {
+        *width = convert_uint(head + 16);
+        *height = convert_uint(head + 20);
+        if (head[28]) {
+            snprintf(err, errlen, "interlaced PNGs aren't supported");
+            return false;
+        }
+    } else {
+        snprintf(err, errlen, "not a PNG or QOI");
+        return false;
+    }
+
+    if (*width == 0 || *height == 0 ||
+        *width > ATLAS_MAX_WIDTH - ATLAS_PADDING) {
+        snprintf(err, errlen, "bad size %ux%u", *width, *height);
+        return false;
+    }
+    return true;
+}
+
+// y the image would be at if it started at skyline segment i, or UINT32_MAX
+// if it doesn't fit there
+uint32_t skyline_fit(Skyline *s, uint32_t count, uint32_t i, uint32_t width,
+                     uint32_t atlas_width) {
+    if (s[i].x + width > atlas_width)
+        return UINT32_MAX;
+
+    uint32_t y = 0, left = width;
+    for (uint32_t j = i; j < count && left > 0; j++) {
+        y = s[j].y > y ? s[j].y : y;
+        left -= s[j].width < left ? s[j].width : left;
+    }
+    return y;
+}
+
+// places sprites bottom left first, the skyline has room for count + 1
+// segments. returns the height of the atlas
+uint32_t skyline_pack(Sprite **sprites, uint32_t count, uint32_t width,
+                      Skyline *s) {
+    uint32_t segments = 1, height = 0;
+    s[0] = (Skyline){0, 0, width};
+
+    for (uint32_t k = 0; k < count; k++) {
+        Sprite *sprite = sprites[k];
+        uint32_t w = sprite->width + ATLAS_PADDING;
+        uint32_t h = sprite->height + ATLAS_PADDING;
+
+        // lowest top, then leftmost
+        uint32_t best = UINT32_MAX, best_y = UINT32_MAX;
+        for (uint32_t i = 0; i < segments; i++) {
+            uint32_t y = skyline_fit(s, segments, i, w, width);
+            if (y < best_y) {
+                best = i;
+                best_y = y;
+            }
+        }
+        if (best == UINT32_MAX)
+            panic("Image is wider than the atlas");
+
+        sprite->x = s[best].x;
+        sprite->y = best_y;
+        if (best_y + h > height)
+            height = best_y + h;
+
+        // the new segment covers the ones below it, the last one may stick out
+        Skyline top = {s[best].x, best_y + h, w};
+        uint32_t end = best;
+        while (end < segments && s[end].x + s[end].width <= top.x + w)
+            end++;
+        if (end < segments && s[end].x < top.x + w) {
+            s[end].width -= top.x + w - s[end].x;
+            s[end].x = top.x + w;
+        }
+        memmove(s + best + 1, s + end, (segments - end) * sizeof(Skyline));
+        segments += best + 1 - end;
+        s[best] = top;
+
+        // neighbours at the same height become one
+        for (uint32_t i = 0; i + 1 < segments;) {
+            if (s[i].y == s[i + 1].y) {
+                s[i].width += s[i + 1].width;
+                memmove(s + i + 1, s + i + 2,
+                        (segments - i - 2) * sizeof(Skyline));
+                segments--;
+            } else {
+                i++;
+            }
+        }
+    }
+
+    return height > ATLAS_PADDING ? height - ATLAS_PADDING : height;
+}
+
+// tallest first, then widest
+int compare_sprites(const void *a, const void *b) {
+    Sprite *x = *(Sprite **)a, *y = *(Sprite **)b;
+    if (x->height != y->height)
+        return x->height > y->height ? -1 : 1;
+    return (x->width < y->width) - (x->width > y->width);
+}
+
+// draws sprite i into the atlas, or leaves its rectangle empty and says why
+bool atlas_sprite(Atlas *a, uint32_t i, char *err, size_t errlen) {
+    Sprite *sprite = &a->sprites[i];
+    size_t stride = (size_t)a->width * 4;
+    uint8_t *dst = a->pixels + sprite->y * stride + (size_t)sprite->x * 4;
+
+    if (is_qoi(sprite->file)) {
+        Image image;
+        if (!read_qoi(sprite->file, &image)) {
+            snprintf(err, errlen, "couldn't read it");
+            return false;
+        }
+        bool same = (uint32_t)image.width == sprite->width &&
+                    (uint32_t)image.height == sprite->height;
+        if (same)
+            for (uint32_t y = 0; y < sprite->height; y++)
+                memcpy(dst + y * stride,
+                       (uint8_t *)image.data + (size_t)y * sprite->width * 4,
+                       (size_t)sprite->width * 4);
+        else
+            snprintf(err, errlen, "changed while packing");
+        free_image(image);
+        return same;
+    }
+
+    PNG png = {0};
+    if (!load_png(sprite->file, &png, err, errlen))
+        return false;
+    bool ok = png.width == sprite->width && png.height == sprite->height;
+    if (!ok) {
+        snprintf(err, errlen, "changed while packing");
+    } else {
+        DecodeOptions opts = {
+            .pixels = dst,
+            .stride = stride,
+            .err = err,
+            .errlen = errlen,
+        };
+        ok = decode_png(&png, &opts).data != NULL;
+    }
+    free_png(&png);
+
+    // rows decoded before the error would show up in the atlas
+    if (!ok)
+        for (uint32_t y = 0; y < sprite->height; y++)
+            memset(dst + y * stride, 0, (size_t)sprite->width * 4);
+    return ok;
+}
+
+void atlas_job(void *arg, uint32_t first, uint32_t last) {
+    Atlas *a = arg;
+    for (uint32_t i = first; i < last; i++) {
+        a->failed[i] = !atlas_sprite(a, i, a->results[i],
+                                     sizeof(a->results[i]));
+    }
+}
+
+// path as a json string
+void write_json_string(FILE *file, const char *s) {
+    fputc('"', file);
+    for (; *s; s++) {
+        if (*s == '"' || *s == '\\')
+            fprintf(file, "\\%c", *s);
+        else if ((uint8_t)*s < 0x20)
+            fprintf(file, "\\u%04x", *s);
+        else
+            fputc(*s, file);
+    }
+    fputc('"', file);
+}
+
+bool write_atlas_json(const char *path, const char *image, Sprite *sprites,
+                      uint32_t count, uint32_t width, uint32_t height) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    fprintf(file, "{\n  \"image\": ");
+    write_json_string(file, image);
+    fprintf(file, ",\n  \"width\": %u,\n  \"height\": %u,\n  \"sprites\": [",
+            width, height);
+    bool first = true;
+    for (uint32_t i = 0; i < count; i++) {
+        Sprite *s = &sprites[i];
+        if (s->file == NULL)
+            continue; // didn't make it in
+        fprintf(file, "%s\n    {\"file\": ", first ? "" : ",");
+        first = false;
+        write_json_string(file, s->file);
+        fprintf(file, ", \"x\": %u, \"y\": %u, \"width\": %u, \"height\": %u}",
+                s->x, s->y, s->width, s->height);
+    }
+    fprintf(file, "\n  ]\n}\n");
+    return fclose(file) == 0;
+}
+
+// packs files into outfile and writes the map next to it as .json. returns
+// the number of files that couldn't go in
+uint32_t atlas_files(char **files, uint32_t count, const char *outfile,
+                     EncodeOptions *encode) {
+    Sprite *sprites = malloc(count * sizeof(Sprite));
+    uint32_t sprite_count = 0;
+    uint64_t area = 0;
+    uint32_t widest = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        Sprite *s = &sprites[sprite_count];
+        char err[256];
+        if (!probe_image(files[i], &s->width, &s->height, err, sizeof(err))) {
+            printf("%s: %s\n", files[i], err);
+            continue;
+        }
+        s->file = files[i];
+        area += (uint64_t)(s->width + ATLAS_PADDING) *
+                (s->height + ATLAS_PADDING);
+        widest = s->width > widest ? s->width : widest;
+        sprite_count++;
+    }
+    if (sprite_count == 0)
+        panic("Nothing to put into the atlas");
+
+    // about square, in powers of two
+    uint32_t width = 64;
+    while (width < ATLAS_MAX_WIDTH &&
+           ((uint64_t)width * width < area || width < widest + ATLAS_PADDING))
+        width *= 2;
+
+    Sprite **order = malloc(sprite_count * sizeof(Sprite *));
+    for (uint32_t i = 0; i < sprite_count; i++)
+        order[i] = &sprites[i];
+    qsort(order, sprite_count, sizeof(Sprite *), compare_sprites);
+
+    Skyline *skyline = malloc((sprite_count + 1) * sizeof(Skyline));
+    uint32_t height = skyline_pack(order, sprite_count, width, skyline);
+    free(skyline);
+    free(order);
+
+    Atlas a = {
+        .sprites = sprites,
+        .pixels = calloc((size_t)width * height, 4), // transparent in between
+        .width = width,
+        .failed = calloc(sprite_count, sizeof(bool)),
+        .results = calloc(sprite_count, sizeof(*a.results)),
+    };
+    if (a.pixels == NULL)
+        panic("Atlas is too big");
+    parallel_for(sprite_count, 1, atlas_job, &a);
+
+    uint32_t packed = sprite_count;
+    for (uint32_t i = 0; i < sprite_count; i++) {
+        if (a.failed[i]) {
+            printf("%s: %s\n", sprites[i].file, a.results[i]);
+            sprites[i].file = NULL;
+            packed--;
+        }
+    }
+
+    Image image = {
+        .data = a.pixels,
+        .width = width,
+        .height = height,
+        .mipmaps = 1,
+        .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8,
+    };
+    if (!write_image(outfile, image, encode))
+        panic("Couldn't write the atlas");
+
+    // the map is the atlas with .json instead of its extension
+    char json[4096];
+    const char *slash = strrchr(outfile, '/');
+    const char *dot = strrchr(slash ? slash : outfile, '.');
+    int stem = dot ? dot - outfile : (int)strlen(outfile);
+    snprintf(json, sizeof(json), "%.*s.json", stem, outfile);
+    if (!write_atlas_json(json, slash ? slash + 1 : outfile, sprites,
+                          sprite_count, width, height))
+        panic("Couldn't write the atlas map");
+
+    printf("%s: %u images in %ux%u, map in %s\n", outfile, packed, width,
+           height, json);
+
+    free(a.failed);
+    free(a.results);
+    free(a.pixels);
+    free(sprites);
+    return count - packed;
+}
+
+/*
+ * Bench
+ *
+ * every file is decoded and resized to half its size once per level the CPU
+ * has, whatever PODER_ISA says, so all kernel tiers run side by side on one
+ * machine. decoded pixels of every level have to match the scalar ones, the
+ * resized ones can be 1 off since FMA rounds once instead of twice.
+ */
+
+#define BENCH_SECONDS 0.25 // per file, level and step
+
+double seconds(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// best of as many runs as fit in BENCH_SECONDS, and the hash of the output
+double bench_decode(PNG *png, uint64_t *hash) {
+    double best = 1e9, start = seconds();
+    do {
+        double t = seconds();
+        Image image = decode_png(png, &(DecodeOptions){0});
+        t = seconds() - t;
+        best = t < best ? t : best;
+        *hash = hash_pixels(image.data, (size_t)image.width * image.height * 4);
+        free(image.data);
+    } while (seconds() - start < BENCH_SECONDS);
+    return best;
+}
+
+// out is the last resized image
+double bench_resize(Image image, Image *out) {
+    uint32_t width = image.width > 1 ? image.width / 2 : 1;
+    uint32_t height = image.height > 1 ? image.height / 2 : 1;
+    double best = 1e9, start = seconds();
+    *out = (Image){0};
+    do {
+        free(out->data);
+        double t = seconds();
+        *out = resize_image(image, width, height, FILTER_LANCZOS3);
+        t = seconds() - t;
+        best = t < best ? t : best;
+    } while (seconds() - start < BENCH_SECONDS);
+    return best;
+}
+
+// largest difference of two images of the same size
+uint32_t max_difference(Image a, Image b) {
+    uint8_t *p = a.data, *q = b.data;
+    uint32_t max = 0;
+    for (size_t i = 0; i < (size_t)a.width * a.height * 4; i++) {
+        uint32_t d = p[i] > q[i] ? p[i] - q[i] : q[i] - p[i];
+        max = d > max ? d : max;
+    }
+    return max;
+}
+
+// returns the number of files where some level got different pixels
+uint32_t bench_files(char **files, uint32_t count) {
+    Isa saved = kernels.isa, top = cpu_isa();
+    uint32_t failed = 0;
+
+    for (uint32_t i = 0; i < count; i++) {
+        PNG png = {0};
+        read_png(files[i], &png);
+        if (png.interlace) {
+            printf("%s: interlaced, skipped\n", files[i]);
+            free_png(&png);
+            continue;
+        }
+
+        double mb = (double)png.width * png.height * 4 / (1 << 20);
+        printf("%s: %ux%u\n", files[i], png.width, png.height);
+
+        uint64_t decode_ref = 0;
+        Image resize_ref = {0};
+        bool same = true;
+        for (Isa isa = ISA_SCALAR; isa <= top; isa++) {
+            use_isa(isa);
+            uint64_t decode_hash;
+            double decode = bench_decode(&png, &decode_hash);
+
+            Image image = decode_png(&png, &(DecodeOptions){0}), resized;
+            double resize = bench_resize(image, &resized);
+            free(image.data);
+
+            if (isa == ISA_SCALAR) {
+                decode_ref = decode_hash;
+                resize_ref = resized;
+            }
+            bool ok = decode_hash == decode_ref &&
+                      max_difference(resized, resize_ref) <= 1;
+            same &= ok;
+            printf("  %-7s decode %8.2f ms %8.1f MB/s   resize %8.2f ms%s\n",
+                   isa_names[isa], decode * 1000, mb / decode, resize * 1000,
+                   ok ? "" : "   DIFFERENT PIXELS");
+            if (isa != ISA_SCALAR)
+                free(resized.data);
+        }
+        free(resize_ref.data);
+        failed += !same;
+        free_png(&png);
+    }
+
+    use_isa(saved);
+    return failed;
+}
+
+#define MAX_WINDOW_WIDTH 1600
+#define MAX_WINDOW_HEIGHT 900
+#define MAX_ZOOM 3.0f
+
+typedef struct {
+    bool gamma_mips; // average mip levels in linear light
+    bool stats;      // frame time overlay, F toggles it
+    bool compress;   // BC1/BC3 tiles instead of RGBA
+    DiskCache *cache; // compressed levels are kept here, can be NULL
+} ViewOptions;
+
+// zoom that fits the image into the window, at most 1
+float fit_zoom(uint width, uint height) {
+    float fit_x = (float)GetScreenWidth() / width;
+    float fit_y = (float)GetScreenHeight() / height;
+    float fit = fit_x < fit_y ? fit_x : fit_y;
+    return fit < 1.f ? fit : 1.f;
+}
+
+// fits the image into the window and centers it, returns the zoom
+float fit_camera(Camera2D *camera, uint width, uint height) {
+    camera->target = (Vector2){width / 2., height / 2.};
+    camera->offset = (Vector2){GetScreenWidth() / 2., GetScreenHeight() / 2.};
+    camera->rotation = 0.0f;
+    camera->zoom = fit_zoom(width, height);
+    return camera->zoom;
+}
+
+void draw_stats(double work, uint64_t redraws, TiledImage *tiles,
+                bool waiting) {
+    const char *text =
+        TextFormat("%.2f ms  %llu frames  %zu MB tiles  %s", work * 1000,
+                   (unsigned long long)redraws, tiles->vram >> 20,
+                   waiting ? "idle" : "busy");
+    DrawRectangle(0, 0, 10 + MeasureText(text, 20) + 10, 40,
+                  (Color){0, 0, 0, 160});
+    DrawText(text, 10, 10, 20, GREEN);
+}
+
+// anim can be NULL, otherwise its frames replace the image as they come.
+// decoder is NULL too unless image is still being decoded by it. with a
+// browser image is its shown file and the others come from it
+void render(uint width, uint height, Image image, Animation *anim,
+            Decoder *decoder, Browser *browser, ViewOptions *opts) {
+    // Raylib shit
+    SetTraceLogLevel(LOG_ERROR);
+    SetConfigFlags(FLAG_WINDOW_RESIZABLE);
+    InitWindow(width < MAX_WINDOW_WIDTH ? width : MAX_WINDOW_WIDTH,
+               height < MAX_WINDOW_HEIGHT ? height : MAX_WINDOW_HEIGHT,
+               "Poder");
+    SetTargetFPS(60);
+    if (browser)
+        SetWindowTitle(TextFormat("Poder - %s", browser->files[browser->shown]));
+
+    // starts fitted into the window, can't get smaller than that
+    Camera2D camera = {0};
+    float min_zoom = fit_camera(&camera, width, height);
+
+    TiledImage tiles;
+    tiles_init(&tiles, image, opts->gamma_mips, decoder != NULL);
+    if (opts->compress && !decoder && !anim)
+        tiles_compress(&tiles, opts->cache);
+
+    // once nothing changes by itself anymore EndDrawing() sleeps until there
+    // is input, instead of drawing the same frame 60 times a second
+    bool waiting = false;
+    bool complete = true; // every tile in view was drawn last frame
+    bool stats = opts->stats;
+    uint64_t redraws = 0;
+    double work = 0;
+
+    while (!WindowShouldClose()) {
+        double start = GetTime();
+
+        if (browser) {
+            if (IsKeyPressed(KEY_RIGHT) || IsKeyPressed(KEY_PAGE_DOWN) ||
+                IsKeyPressed(KEY_SPACE))
+                browser_step(browser, 1);
+            if (IsKeyPressed(KEY_LEFT) || IsKeyPressed(KEY_PAGE_UP))
+                browser_step(browser, -1);
+
+            // the cache owns the images, the old one just stops being shown
+            uint32_t file;
+            if (browser_take(browser, &image, &file)) {
+                tiles_free(&tiles);
+                width = image.width;
+                height = image.height;
+                tiles_init(&tiles, image, opts->gamma_mips, false);
+                if (opts->compress)
+                    tiles_compress(&tiles, opts->cache);
+                min_zoom = fit_camera(&camera, width, height);
+                SetWindowTitle(TextFormat("Poder - %s", browser->files[file]));
+            }
+        }
+
+        if (IsWindowResized())
+            min_zoom = fit_zoom(width, height);
+
+        if (tiles.partial) {
+            tiles_progress(&tiles, atomic_load(&decoder->rows));
+            if (!tiles.partial && opts->compress)
+                tiles_compress(&tiles, opts->cache);
+        }
+
+        if (anim && animation_update(anim, image.data))
+            tiles_invalidate(&tiles);
+
+        // zoom towards the mouse, drag to move around
+        float wheel = GetMouseWheelMove();
+        if (wheel != 0) {
+            Vector2 mouse = GetMousePosition();
+            camera.target = GetScreenToWorld2D(mouse, camera);
+            camera.offset = mouse;
+            camera.zoom = expf(logf(camera.zoom) + wheel * 0.1f);
+        }
+
+        if (camera.zoom > MAX_ZOOM)
+            camera.zoom = MAX_ZOOM;
+        else if (camera.zoom < min_zoom)
+            camera.zoom = min_zoom;
+
+        if (IsMouseButtonDown(MOUSE_BUTTON_LEFT)) {
+            Vector2 delta = GetMouseDelta();
+            camera.target.x -= delta.x / camera.zoom;
+            camera.target.y -= delta.y / camera.zoom;
+        }
+
+        BeginDrawing();
+        BeginMode2D(camera);
+
+        ClearBackground(BLACK);
+        complete = tiles_draw(&tiles, camera);
+
+        EndMode2D();
+
+        if (IsKeyPressed(KEY_F))
+            stats = !stats;
+        if (stats)
+            draw_stats(work, redraws, &tiles, waiting);
+
+        if (IsKeyPressed(KEY_S))
+            take_screenshot();
+
+        if (browser)
+            browser_set_gpu(browser, tiles.vram);
+
+        bool busy = tiles.partial || !complete ||
+                    (anim && !animation_done(anim)) ||
+                    (browser && browser_waiting(browser));
+        if (busy && waiting)
+            DisableEventWaiting();
+        else if (!busy && !waiting)
+            EnableEventWaiting();
+        waiting = !busy;
+
+        redraws++;
+        work = GetTime() - start;
+        EndDrawing();
+    }
+
+    wait_screenshots();
+    if (anim)
+        animation_stop(anim);
+    if (decoder)
+        decoder_stop(decoder);
+
+    tiles_free(&tiles);
+    if (browser)
+        browser_stop(browser);
+    else
+        free_image(image);
+
+    CloseWindow();
+}
+
+int main(int argc, char **argv) {
+    const char *command = NULL; // optimize, strip, transcode, atlas or bench
+    bool dry_run = false;
+    StripOptions strip = {.keep = calloc(argc, sizeof(char *)),
+                          .drop = calloc(argc, sizeof(char *))};
+    char *files[argc];
+    uint32_t file_count = 0;
+    uint32_t index_span = 0; // build a seek index with a point every n rows
+    bool verify = false;
+    const char *outfile = NULL; // encode the decoded image here
+    EncodeOptions encode = {0};
+    DecodeOptions opts = {0};
+    uint32_t resize_width = 0;
+    uint32_t resize_height = 0;
+    ResizeFilter resize_filter = FILTER_LANCZOS3;
+    ViewOptions view = {0};
+    DiskCache disk_cache = {.budget = DISK_CACHE_BUDGET};
+
+    use_isa(detect_isa());
+
+    int first = 1;
+    if (argc > 1 && (strcmp(argv[1], "optimize") == 0 ||
+                     strcmp(argv[1], "strip") == 0 ||
+                     strcmp(argv[1], "transcode") == 0 ||
+                     strcmp(argv[1], "atlas") == 0 ||
+                     strcmp(argv[1], "bench") == 0))
+        command = argv[first++];
+
+    for (int i = first; i < argc; i++) {
+        if (strcmp(argv[i], "--dry-run") == 0) {
+            dry_run = true;
+        } else if (strcmp(argv[i], "--keep") == 0 && i + 1 < argc) {
+            // comma separated chunk types
+            for (char *type = strtok(argv[++i], ","); type;
+                 type = strtok(NULL, ","))
+                strip.keep[strip.keep_count++] = type;
+        } else if (strcmp(argv[i], "--drop") == 0 && i + 1 < argc) {
+            for (char *type = strtok(argv[++i], ","); type;
+                 type = strtok(NULL, ","))
+                strip.drop[strip.drop_count++] = type;
+        } else if (strcmp(argv[i], "--merge-idat") == 0) {
+            strip.merge_idat = true;
+        } else if (strcmp(argv[i], "--index") == 0 && i + 1 < argc) {
+            index_span = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = true;
+        } else if (strcmp(argv[i], "--gamma-mips") == 0) {
+            view.gamma_mips = true;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            view.stats = true;
+        } else if (strcmp(argv[i], "--bc") == 0) {
+            view.compress = true;
+        } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+            disk_cache.dir = argv[++i];
+        } else if (strcmp(argv[i], "--cache-mb") == 0 && i + 1 < argc) {
+            disk_cache.budget = (size_t)atoi(argv[++i]) << 20;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outfile = argv[++i];
+        } else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+            encode.level = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            char *filter = argv[++i];
+            if (strcmp(filter, "minsum") == 0) {
+                encode.select = SELECT_MINSUM;
+            } else if (strcmp(filter, "entropy") == 0) {
+                encode.select = SELECT_ENTROPY;
+            } else if (strcmp(filter, "brute") == 0) {
+                encode.select = SELECT_BRUTE;
+            } else if (filter[0] >= '0' && filter[0] <= '4' && !filter[1]) {
+                encode.select = SELECT_FIXED;
+                encode.filter = filter[0] - '0';
+            } else {
+                panic("--filter takes minsum, entropy, brute or 0-4");
+            }
+        } else if (strcmp(argv[i], "--crop") == 0 && i + 1 < argc) {
+            Region *r = &opts.region;
+            if (sscanf(argv[++i], "%u,%u,%u,%u", &r->x, &r->y, &r->width,
+                       &r->height) != 4)
+                panic("--crop takes x,y,w,h");
+        } else if (strcmp(argv[i], "--scale") == 0 && i + 1 < argc) {
+            opts.scale = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--raw-color") == 0) {
+            opts.raw_color = true;
+        } else if (strcmp(argv[i], "--premultiply") == 0) {
+            opts.premultiply = true;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            const char *name = argv[++i];
+            if (strcmp(name, "bgra") == 0)
+                opts.format = OUTPUT_BGRA8;
+            else if (strcmp(name, "rgba16") == 0)
+                opts.format = OUTPUT_RGBA16;
+            else if (strcmp(name, "rgba") != 0)
+                panic("--format takes rgba, bgra or rgba16");
+        } else if (strcmp(argv[i], "--resize") == 0 && i + 1 < argc) {
+            char filter[16] = "lanczos";
+            if (sscanf(argv[++i], "%ux%u:%15s", &resize_width, &resize_height,
+                       filter) < 2)
+                panic("--resize takes WxH[:lanczos|bicubic]");
+            if (strcmp(filter, "bicubic") == 0)
+                resize_filter = FILTER_BICUBIC;
+            else if (strcmp(filter, "lanczos") != 0)
+                panic("Unknown resize filter");
+        } else {
+            files[file_count++] = argv[i];
+        }
+    }
+
+    if (disk_cache.dir)
+        view.cache = &disk_cache;
+    // decoded images in the cache are color managed, --raw-color skips it
+    DiskCache *decoded_cache =
+        disk_cache.dir && !opts.raw_color ? &disk_cache : NULL;
+    if (file_count == 0)
+        files[file_count++] = "pngs/chart.png";
+    const char *pngfile = files[0];
+
+    if (verify)
+        return verify_files(files, file_count) ? 1 : 0;
+    if (command && strcmp(command, "optimize") == 0)
+        return optimize_files(files, file_count, dry_run) ? 1 : 0;
+    if (command && strcmp(command, "strip") == 0) {
+        strip.outfile = outfile;
+        return strip_files(files, file_count, &strip) ? 1 : 0;
+    }
+    if (command && strcmp(command, "transcode") == 0)
+        return transcode_files(files, file_count, &encode) ? 1 : 0;
+    if (command && strcmp(command, "bench") == 0)
+        return bench_files(files, file_count) ? 1 : 0;
+    if (command && strcmp(command, "atlas") == 0) {
+        uint32_t count;
+        char **list = list_images(files, file_count, &count);
+        const char *atlas = outfile ? outfile : "atlas.png";
+        return atlas_files(list, count, atlas, &encode) ? 1 : 0;
+    }
+
+    // a directory or several files get browsed
+    struct stat st;
+    if (!outfile && (file_count > 1 ||
+                     (stat(pngfile, &st) == 0 && S_ISDIR(st.st_mode)))) {
+        uint32_t count;
+        char **list = list_images(files, file_count, &count);
+        if (count == 0)
+            panic("No PNGs to browse");
+
+        Browser *browser =
+            browser_start(list, count, decoded_cache, opts.raw_color);
+        Image image;
+        uint32_t file, tried = 0;
+        while (!browser_take(browser, &image, &file)) {
+            if (!browser_waiting(browser)) {
+                if (++tried == count)
+                    panic("None of the PNGs could be decoded");
+                browser_step(browser, 1); // broken, try the next one
+            }
+            usleep(1000);
+        }
+
+        render(image.width, image.height, image, NULL, NULL, browser, &view);
+        for (uint32_t i = 0; i < count; i++)
+            free(list[i]);
+        free(list);
+        return 0;
+    }
+
+    // just viewing it, the window opens before the decode is done or with
+    // the pixels from the disk cache
+    bool viewing = !outfile && !index_span && !resize_width &&
+                   opts.region.width == 0 && opts.scale <= 1;
+
+    Image cached;
+    if (viewing && decoded_cache &&
+        disk_cache_load(decoded_cache, pngfile, &cached)) {
+        printf("%s: %ux%u from %s\n", pngfile, cached.width, cached.height,
+               disk_cache.dir);
+        render(cached.width, cached.height, cached, NULL, NULL, NULL, &view);
+        return 0;
+    }
+
+    // the encoders and the window only take straight rgba8
+    if ((opts.format != OUTPUT_RGBA8 || opts.premultiply) &&
+        (!outfile || !has_extension(outfile, ".raw") || resize_width ||
+         is_qoi(pngfile)))
+        panic("--format and --premultiply only work on PNGs with -o file.raw, "
+              "no --resize");
+
+    // qoi has no rows to seek to or decode partially
+    if (is_qoi(pngfile)) {
+        if (index_span || opts.region.width || opts.scale > 1)
+            panic("--index, --crop and --scale only work on PNGs");
+
+        Image image;
+        if (!read_qoi(pngfile, &image))
+            panic("Broken QOI file");
+        printf("%s: %ux%u QOI\n", pngfile, image.width, image.height);
+
+        if (resize_width) {
+            Image resized = resize_image(image, resize_width, resize_height,
+                                         resize_filter);
+            UnloadImage(image);
+            image = resized;
+        }
+
+        if (outfile) {
+            bool ok = write_image(outfile, image, &encode);
+            UnloadImage(image);
+            if (!ok)
+                panic("Couldn't write the image");
+            return 0;
+        }
+
+        render(image.width, image.height, image, NULL, NULL, NULL, &view);
+        return 0;
+    }
+
+    PNG png = {0};
+    read_png(pngfile, &png);
+
+    printf("%s: %ux%u, %u depth and %u color type with %zu bytes data\n",
+           pngfile, png.width, png.height, png.bit_depth, png.color_type,
+           png.data_t);
+
+    if (viewing && png.frame_count < 2) {
+        Decoder decoder;
+        Image image = decoder_start(&decoder, &png, pngfile, decoded_cache,
+                                    opts.raw_color);
+        render(image.width, image.height, image, NULL, &decoder, NULL, &view);
+        free_png(&png);
+        return 0;
+    }
+
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s.pidx", pngfile);
+
+    SeekIndex index = {.span = index_span};
+    if (index_span)
+        opts.record = &index;
+    else if (opts.region.y > 0 && load_index(index_path, &png, &index))
+        opts.seek = &index;
+
+    Image image = decode_png(&png, &opts);
+
+    if (resize_width) {
+        Image resized =
+            resize_image(image, resize_width, resize_height, resize_filter);
+        UnloadImage(image);
+        image = resized;
+    }
+
+    if (index_span) {
+        save_index(index_path, &png, &index);
+        printf("%s: %u access points\n", index_path, index.count);
+    }
+
+    free_index(&index);
+
+    if (outfile) {
+        free_png(&png);
+        bool ok = write_image(outfile, image, &encode);
+        UnloadImage(image);
+        if (!ok)
+            panic("Couldn't write the image");
+        return 0;
+    }
+
+    // animations only play on the whole image
+    Animation *anim = NULL;
+    if (opts.region.width == 0 && opts.scale <= 1 && resize_width == 0)
+        anim = animation_start(&png);
 
-    render(width, height, image);
+    render(image.width, image.height, image, anim, NULL, NULL, &view);
+    free_png(&png);
 }